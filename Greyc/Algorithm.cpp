@@ -6,17 +6,22 @@
 #include "Helpers.h"
 #include "StringUtil.h"
 #include "GreycC.h"
+#include "GaussianBlur.h"
+#include "DericheBlur.h"
 #include <vector>
 #include <algorithm>
 using namespace std;
 #include <assert.h>
 #include <math.h>
+#include <float.h>
 
 #pragma warning (disable : 4244) // 'initializing' : conversion from 'int' to 'const float', possible loss of data
 #pragma warning (disable : 4101) // unreferenced local variable
 
 #include <windows.h>
 
+/* The most memory to use for the per-group accumulators of ANGLES_TASKS. */
+static const __int64 g_iMaxAngleTaskBytes = 512*1024*1024;
 
 Algorithm::Algorithm():
 	m_iProgressCounter(0),
@@ -27,6 +32,9 @@ Algorithm::Algorithm():
 	m_iThreadsRunning = 0;
 	m_hMainThreadHandle = NULL;
 	m_bFinished = false;
+	m_bFlatActive = false;
+	m_bLumaChroma = false;
+	m_bSkipBlock = false;
 
 	/* We create the first thread once and leave it running, since OpenGL contexts are
 	 * associated with the thread and if we recreate it every time it adds about 100ms
@@ -53,12 +61,79 @@ void Algorithm::SetMask(const CImg &mask)
 	m_Mask.Hold(mask);
 }
 
+/* Variants can share the prep and tensor stages if everything those read is the same. */
+static bool SweepSharesTensors(const AlgorithmSettings &a, const AlgorithmSettings &b)
+{
+	return a.m_fInputScale == b.m_fInputScale && a.m_fPreBlur == b.m_fPreBlur &&
+		a.alpha == b.alpha && a.sigma == b.sigma && a.gfact == b.gfact &&
+		a.sharpness == b.sharpness && a.anisotropy == b.anisotropy &&
+		a.tensor_scale == b.tensor_scale;
+}
+
+/* Variants that share tensors can also share W if they walk the same angles with the same step. */
+static bool SweepSharesW(const AlgorithmSettings &a, const AlgorithmSettings &b)
+{
+	return a.da == b.da && a.dl == b.dl && a.bidirectional == b.bidirectional;
+}
+
+void Algorithm::SetSweep(const vector<AlgorithmSettings> &aVariants, const vector<CImg *> &apTargets)
+{
+	if(aVariants.size() != apTargets.size())
+		throw Exception("Algorithm::SetSweep: each variant needs a target");
+
+	for(size_t i = 0; i < aVariants.size(); ++i)
+	{
+		const AlgorithmSettings &v = aVariants[i];
+		if(v.iterations != 1 || v.flat_threshold > 0 || v.adaptive_angles > 0 || v.luma_chroma || v.partial_stage_output != 0 ||
+			v.w_format != AlgorithmSettings::W_FLOAT || v.fast_lic ||
+			v.angle_scheduling != AlgorithmSettings::ANGLES_PER_PASS)
+			throw Exception("Algorithm::SetSweep: unsupported variant settings");
+		if(v.dl<0 || v.da<0 || v.gauss_prec<0)
+			throw Exception("dl>0, da>0, gauss_prec>0");
+		if(v.tensor_scale < 0)
+			throw Exception("tensor_scale>=0");
+	}
+
+	m_aSweepVariants = aVariants;
+	m_apSweepTargets = apTargets;
+
+	/* Group the variants, in order of first appearance. */
+	m_aSweepGroups.clear();
+	for(int i = 0; i < (int) aVariants.size(); ++i)
+	{
+		size_t iGroup = 0;
+		while(iGroup < m_aSweepGroups.size() && !SweepSharesTensors(aVariants[m_aSweepGroups[iGroup].aaiWalkGroups[0][0]], aVariants[i]))
+			++iGroup;
+		if(iGroup == m_aSweepGroups.size())
+			m_aSweepGroups.push_back(SweepGroup());
+
+		vector<vector<int> > &aaiWalkGroups = m_aSweepGroups[iGroup].aaiWalkGroups;
+		size_t iWalk = 0;
+		while(iWalk < aaiWalkGroups.size() && !SweepSharesW(aVariants[aaiWalkGroups[iWalk][0]], aVariants[i]))
+			++iWalk;
+		if(iWalk == aaiWalkGroups.size())
+			aaiWalkGroups.push_back(vector<int>());
+		aaiWalkGroups[iWalk].push_back(i);
+	}
+}
+
+void Algorithm::ClearSweep()
+{
+	m_aSweepVariants.clear();
+	m_apSweepTargets.clear();
+	m_aSweepGroups.clear();
+}
+
 /* Get the number of channels to process.  If OpenGL is enabled, always process four channels.
- * If more SSE optimizations are implemented, this should force four channels. */
+ * A single-channel document (grayscale or a mask) is processed as one channel: the blurs and the
+ * SIMT walker run their SIMD lanes across pixels instead, and the padding channels would only
+ * be three planes of zeroes.  Anything else is padded to four channels for the SSE paths. */
 int Algorithm::GetProcessedChannels() const
 {
 	if(m_Options.m_bGPU)
 		return 4;
+	else if(m_SourceImage.m_iChannels == 1)
+		return 1;
 	else
 		return max(4, m_SourceImage.m_iChannels);
 }
@@ -70,7 +145,24 @@ void Algorithm::Finish()
 	m_bFinished = false;
 	m_G.free();
 	m_G2.free();
+	m_W.free();
+	m_Flat.Weight.Free();
+	m_Flat.Blurred[0].free();
+	m_Flat.Blurred[1].free();
+	for(int i = 0; i < AdaptiveAngles::MAX_LEVEL; ++i)
+		m_Angles.Mask[i].Free();
+	m_AngleTaskAccumulators.clear();
 	m_Dest.free();
+	m_Luma.free();
+	m_Chroma.free();
+	m_ChromaG2.free();
+	m_ChromaW.free();
+	m_ChromaDest.free();
+	m_ChromaMask.Free();
+	m_PreBlur.Free();
+	m_SweepSource.free();
+	m_SweepResult.free();
+	m_aSweepDest.clear();
 
 	for(size_t i = 0; i < m_ahWorkerThreadHandles.size(); ++i)
 	{
@@ -173,6 +265,14 @@ void Algorithm::Run()
 	if(!m_Mask.Empty() && (m_Mask.m_iWidth != m_SourceImage.m_iWidth || m_Mask.m_iHeight != m_SourceImage.m_iHeight))
 		throw Exception("Given mask and image have different dimensions");
 
+	for(size_t i = 0; i < m_apSweepTargets.size(); ++i)
+	{
+		const CImg &Target = *m_apSweepTargets[i];
+		if(Target.m_iWidth != m_SourceImage.m_iWidth || Target.m_iHeight != m_SourceImage.m_iHeight ||
+			Target.m_iChannels != m_SourceImage.m_iChannels || Target.m_iBytesPerChannel != m_SourceImage.m_iBytesPerChannel)
+			throw Exception("Given sweep target and image have different formats");
+	}
+
 	const AlgorithmSettings &s = GetSettings();
 	m_bStopRequest = false;
 	m_iProgressCounter = 0;
@@ -237,16 +337,36 @@ float Algorithm::Progress() const
 		maxcounter *= m_ProcBlocks.GetTotalBlocks();
 	}
 	else
-	{
-		const float factor = 2 * (360/da) + 1;
-		maxcounter = m_ProcBlocks.GetTotalRows()*factor;
-	}
-	maxcounter *= s.iterations;
+		maxcounter = m_ProcBlocks.GetTotalRows()*GetProgressPerRow();
+	if(m_aSweepVariants.empty())
+		maxcounter *= s.iterations;
 	if(maxcounter == 0)
 		return 1.0f;
 	return min(m_iProgressCounter*99.9f/maxcounter,99.9f) / 100.0f;
 }
 
+/* Get the progress counted for each row of a block, for each iteration on the CPU. */
+float Algorithm::GetProgressPerRow() const
+{
+	if(m_aSweepVariants.empty())
+		return 2 * (360/GetSettings().da) + 1;
+
+	/* In a sweep, each tensor group counts its tensors once, and each walk group counts W
+	 * once per angle plus one walk per variant. */
+	float fTotal = 0;
+	for(size_t iGroup = 0; iGroup < m_aSweepGroups.size(); ++iGroup)
+	{
+		const SweepGroup &Group = m_aSweepGroups[iGroup];
+		fTotal += 1;
+		for(size_t iWalk = 0; iWalk < Group.aaiWalkGroups.size(); ++iWalk)
+		{
+			const vector<int> &aiVariants = Group.aaiWalkGroups[iWalk];
+			fTotal += (360/m_aSweepVariants[aiVariants[0]].da) * (1 + aiVariants.size());
+		}
+	}
+	return fTotal;
+}
+
 void Algorithm::Abort()
 {
 	m_ProcessingMutex.Lock();
@@ -312,6 +432,102 @@ void Algorithm::Synchronize()
 		throw AbortedException();
 }
 
+/*
+ * Generate the structure tensors m_G from m_WorkImage on all threads; this is do_blur_anisotropic_prep
+ * with each stage split into slices.  All threads must call this together, and it returns once
+ * m_G is ready.
+ */
+void Algorithm::Prep(int iThreadNo, const AlgorithmSettings &s, float fPreBlur, int iTensorScale)
+{
+	const float alpha = max(s.alpha, 0.0f);
+	const float geom_factor = s.gfact * s.m_fInputScale;
+	double fTime = gettime();
+
+	if(fPreBlur > 0)
+	{
+		for(int iPass = 0; iPass < GaussianBlurPasses::PASSES; ++iPass)
+		{
+			Synchronize();
+			if(iThreadNo == 0)
+			{
+				if(iPass == 0)
+					m_PreBlur.Init(m_WorkImage, fPreBlur);
+				if(iPass == 4)
+				{
+					printf("Timing (prep): gaussian rows %f\n", gettime() - fTime); fTime = gettime();
+				}
+				m_Slices.Init(m_PreBlur.GetSliceCount(iPass));
+			}
+			Synchronize();
+			m_PreBlur.Run(iPass, m_WorkImage, &m_Slices, &m_bStopRequest);
+		}
+
+		Synchronize();
+		if(iThreadNo == 0)
+		{
+			m_PreBlur.Free();
+			printf("Timing (prep): gaussian columns %f\n", gettime() - fTime); fTime = gettime();
+		}
+	}
+
+	/* Normalizing needs the range of the whole blurred image.  Each thread finds the range of its
+	 * bands, and merges it into the total. */
+	if(geom_factor <= 0)
+	{
+		Synchronize();
+		if(iThreadNo == 0)
+		{
+			m_fPrepMin = FLT_MAX;
+			m_fPrepMax = -FLT_MAX;
+			m_Slices.Init(get_prep_band_count(m_WorkImage, alpha));
+		}
+		Synchronize();
+
+		float fMin = FLT_MAX, fMax = -FLT_MAX;
+		do_blur_anisotropic_prep_range(m_WorkImage, alpha, &m_Slices, &m_bStopRequest, fMin, fMax);
+		m_ProcessingMutex.Lock();
+		m_fPrepMin = min(m_fPrepMin, fMin);
+		m_fPrepMax = max(m_fPrepMax, fMax);
+		m_ProcessingMutex.Unlock();
+	}
+
+	Synchronize();
+	if(iThreadNo == 0)
+	{
+		if(geom_factor <= 0)
+		{
+			printf("Timing (prep): normalize range %f\n", gettime() - fTime); fTime = gettime();
+		}
+		alloc_prep_tensors(m_WorkImage, m_G, iTensorScale);
+		m_Slices.Init(get_prep_band_count(m_WorkImage, alpha));
+	}
+	Synchronize();
+
+	const float fGradientScale = get_prep_gradient_scale(geom_factor, m_fPrepMin, m_fPrepMax);
+	do_blur_anisotropic_prep_tensors(m_WorkImage, m_G, alpha, fGradientScale, iTensorScale, &m_Slices, &m_bStopRequest);
+
+	/* Blur the tensors by sigma: rows, then bands of columns. */
+	const float sigma = get_prep_sigma(s.sigma, iTensorScale);
+	Synchronize();
+	if(iThreadNo == 0)
+	{
+		printf("Timing (prep): alpha blur and structure tensors %f\n", gettime() - fTime); fTime = gettime();
+		m_Slices.Init(get_deriche_slice_count(m_G, 'x'));
+	}
+	Synchronize();
+	deriche(m_G, sigma, 'x', &m_Slices, &m_bStopRequest);
+
+	Synchronize();
+	if(iThreadNo == 0)
+		m_Slices.Init(get_deriche_slice_count(m_G, 'y'));
+	Synchronize();
+	deriche(m_G, sigma, 'y', &m_Slices, &m_bStopRequest);
+
+	Synchronize();
+	if(iThreadNo == 0)
+		printf("Timing (prep): sigma %f\n", gettime() - fTime);
+}
+
 /* Process m_img, outputting into m_Temp. */
 void Algorithm::Denoise(int iThreadNo, int iIteraton)
 {
@@ -319,6 +535,11 @@ void Algorithm::Denoise(int iThreadNo, int iIteraton)
 	const AlgorithmOptions &o = GetOptions();
 	volatile LONG *pProgress = &m_iProgressCounter;
 
+	/* The GPU path and the intermediate stage output need the tensors at full resolution. */
+	int iTensorScale = s.tensor_scale > 0? s.tensor_scale:get_auto_tensor_scale(s.sigma);
+	if(o.m_bGPU || s.partial_stage_output != 0)
+		iTensorScale = 1;
+
 	/* Handle the heavyweight allocations now that our synchronization is set up, so if
 	 * we throw an exception, the threads will be cancelled cleanly. */
 
@@ -343,11 +564,18 @@ void Algorithm::Denoise(int iThreadNo, int iIteraton)
 		if(!bMaskIsUsed)
 			m_WorkMask.Free();
 
-		/* Generate the structure tensors, m_G.  This is relatively quick and not threaded.
-		 * Only do m_fPreBlur on the first iteration. */
-		double tt = gettime();
-		do_blur_anisotropic_prep(m_WorkImage, m_G, &m_bStopRequest, o.m_bGPU? NULL:&m_iProgressCounter,
-			iIteraton == 0? s.m_fPreBlur:0, s.alpha, s.sigma, s.gfact * s.m_fInputScale, s.partial_stage_output);
+		/* The intermediate stage output comes from the single-threaded prep. */
+		if(s.partial_stage_output != 0)
+			do_blur_anisotropic_prep(m_WorkImage, m_G, &m_bStopRequest,
+				iIteraton == 0? s.m_fPreBlur:0, s.alpha, s.sigma, s.gfact * s.m_fInputScale, iTensorScale, s.partial_stage_output);
+	}
+
+	/* Generate the structure tensors, m_G.  Only do m_fPreBlur on the first iteration. */
+	double tt = gettime();
+	if(s.partial_stage_output == 0)
+		Prep(iThreadNo, s, iIteraton == 0? s.m_fPreBlur:0, iTensorScale);
+	if(iThreadNo == 0)
+	{
 		printf("Timing: prep %f\n", gettime() - tt);
 		if(o.m_bGPU)
 			progress;
@@ -374,48 +602,219 @@ void Algorithm::Denoise(int iThreadNo, int iIteraton)
 	}
 	else
 	{
+		/* In luma/chroma mode, the tensors come from the whole image as usual, but luma is
+		 * walked in place of m_WorkImage, and chroma separately below. */
+		if(m_bLumaChroma)
+		{
+			Synchronize();
+			if(iThreadNo == 0)
+			{
+				m_Luma.alloc(m_WorkImage.width, m_WorkImage.height, m_SourceImage.m_iChannels - 2);
+				m_Chroma.alloc((m_WorkImage.width + 1) / 2, (m_WorkImage.height + 1) / 2, 2);
+				if(!m_WorkMask.Empty())
+					m_ChromaMask.Alloc(m_Chroma.width, m_Chroma.height, 1, 1);
+				else
+					m_ChromaMask.Free();
+				m_Slices.Init(m_Chroma.height);
+			}
+			Synchronize();
+			do_luma_chroma_split(m_WorkImage, m_SourceImage.m_iChannels, m_WorkMask, m_Luma, m_Chroma, m_ChromaMask,
+				&m_Slices, &m_bStopRequest);
+		}
+		CImgF &WalkImage = m_bLumaChroma? m_Luma:m_WorkImage;
+
+		/* Walk opposite angles together, from the W for the first of them. */
+		const bool bBidirectional = s.bidirectional && angles_have_opposites(s.da);
+		const float fMaxTheta = bBidirectional? 180.0f:360.0f;
+
+		/* Adaptive angles need a mask per angle, so they only apply to walking one angle at a time
+		 * over the whole block.  FastLIC reads the mask as the extent of its streamlines. */
+		const bool bAdaptiveAngles = s.adaptive_angles > 0 && s.angle_scheduling == AlgorithmSettings::ANGLES_PER_PASS &&
+			!(s.fast_lic && s.fast_approx);
+
 		/* From m_G, process the structure tensors m_G2.  m_G is read-only; each thread writes only
 		 * to its portion of m_G2, and does not read m_G2. */
 		Synchronize();
 		if(iThreadNo == 0)
 		{
-			m_G2.alloc(m_WorkImage.width, m_WorkImage.height, 4);
+			m_G2.alloc(m_G.width, m_G.height, 4);
 			m_G2.fill(0);
-			m_Slices.Reset();
+			m_Flat.fThreshold = s.flat_threshold;
+			if(s.flat_threshold > 0)
+				m_Flat.Weight.Alloc(WalkImage.width, WalkImage.height, 1, 1);
+			if(bAdaptiveAngles)
+			{
+				int iSteps = 0;
+				for(float theta=(360%(int)s.da)/2.0f; theta<fMaxTheta; theta += s.da)
+					++iSteps;
+				m_Angles.fThreshold = s.adaptive_angles;
+				set_adaptive_angle_counts(m_Angles, iSteps, bBidirectional);
+				for(int i = 0; i < AdaptiveAngles::MAX_LEVEL; ++i)
+					m_Angles.Mask[i].Alloc(WalkImage.width, WalkImage.height, 1, 1);
+			}
+			m_Slices.Init(m_G.height);
 		}
 		Synchronize();
 
 		double fTime = gettime();
-		do_blur_anisotropic(m_G, m_G2, &m_bStopRequest, &m_iProgressCounter, &m_Slices, s.sharpness, s.anisotropy);
+		do_blur_anisotropic(m_G, m_G2, &m_bStopRequest, &m_iProgressCounter, &m_Slices, s.sharpness, s.anisotropy, o.m_bSIMD,
+			m_WorkMask, s.flat_threshold > 0? &m_Flat:NULL, bAdaptiveAngles? &m_Angles:NULL, iTensorScale);
 
 		printf("Timing: do_blur_anisotropic %f\n", gettime() - fTime); fTime = gettime();
 		Synchronize();
 
+		/* Blur the flat regions, and walk only the rest. */
 		if(iThreadNo == 0)
-			m_G.alloc(m_WorkImage.width, m_WorkImage.height, 4);
+			m_bFlatActive = s.flat_threshold > 0 && do_blur_anisotropic_flat_prep(WalkImage, m_Flat,
+				s.amplitude, s.gauss_prec, s.fast_approx, s.sharpness, s.anisotropy);
+		Synchronize();
+
+		for(int i = 0; m_bFlatActive && i < 2; ++i)
+		{
+			for(int iAxis = 0; iAxis < 2; ++iAxis)
+			{
+				const char axe = iAxis == 0? 'x':'y';
+				Synchronize();
+				if(iThreadNo == 0)
+					m_Slices.Init(get_deriche_slice_count(m_Flat.Blurred[i], axe));
+				Synchronize();
+				deriche(m_Flat.Blurred[i], m_Flat.afSigma[i], axe, &m_Slices, &m_bStopRequest);
+			}
+		}
 
 		Synchronize();
+		if(iThreadNo == 0 && s.flat_threshold > 0)
+			printf("Timing: flat prep %f\n", gettime() - fTime);
+		const CImg &WalkMask = m_bFlatActive? m_Flat.Weight:m_WorkMask;
 
-	double tt = gettime();
 		int N = 0;
 		for(float theta=(360%(int)s.da)/2.0f; theta<360; theta += s.da)
-		{
 			++N;
-			Synchronize();
+
+		/* Half floats need F16C; fall back on fixed point without it. */
+		const bool bCompactW = s.w_format != AlgorithmSettings::W_FLOAT;
+		CImgW::Format CompactFormat = CImgW::FIXED;
+		if(s.w_format == AlgorithmSettings::W_HALF && (GetSIMDFeatures() & SIMD_F16C))
+			CompactFormat = CImgW::HALF;
+
+		/* Angle tasks need an accumulator the size of the block for each group of angles.  Use
+		 * one group per thread, but no more than fit in g_iMaxAngleTaskBytes.  A single group
+		 * is always allowed; its tasks still run in parallel across bands. */
+		const __int64 iAccumulatorBytes = (__int64) WalkImage.width * WalkImage.height * WalkImage.dim * sizeof(float);
+		const int iAngleGroups = (int) clamp(g_iMaxAngleTaskBytes / max(iAccumulatorBytes, (__int64) 1), (__int64) 1, (__int64) iNumThreads);
+
+		tt = gettime();
+		if(s.angle_scheduling == AlgorithmSettings::ANGLES_TASKS)
+		{
+			/* Each task computes its own W, so we don't need m_G at all. */
 			if(iThreadNo == 0)
-				m_Slices.Reset();
+			{
+				m_G.free();
+
+				/* Bands are cleared when first touched. */
+				if(iAngleGroups < iNumThreads)
+					printf("Angle tasks: %i groups of angles for %i threads, to fit the accumulators in memory\n", iAngleGroups, iNumThreads);
+				m_AngleTaskAccumulators.resize(iAngleGroups);
+				for(int i = 0; i < iAngleGroups; ++i)
+				{
+					m_AngleTaskAccumulators[i].Dest.alloc(WalkImage.width, WalkImage.height, WalkImage.dim);
+					m_AngleTaskAccumulators[i].abBandsTouched.assign((WalkImage.height + s.tile_size - 1) / s.tile_size, false);
+				}
+				m_Slices.Init(get_angle_task_count(WalkImage, s.tile_size, iAngleGroups));
+			}
 			Synchronize();
-			do_blur_anisotropic_init_for_angle(m_G2, m_G, &m_bStopRequest, &m_iProgressCounter,
-				&m_Slices, theta, s.dl);
 
-			/* Run the blur. */
+			do_blur_anisotropic_angle_tasks(WalkImage, m_G2, iTensorScale, WalkMask, &m_AngleTaskAccumulators[0], iAngleGroups, &m_bStopRequest, &m_iProgressCounter,
+					&m_Slices, s.tile_size, bCompactW, CompactFormat, s.da,
+					s.alt_amplitude, s.amplitude, s.dl, s.gauss_prec, s.interpolation, s.fast_approx, s.simt_walk, bBidirectional);
+
+			/* Sum the accumulators into m_Dest. */
 			Synchronize();
 			if(iThreadNo == 0)
-				m_Slices.Reset();
+				m_Slices.Init(WalkImage.height);
 			Synchronize();
-			do_blur_anisotropic_with_vectors_angle(m_WorkImage, m_G, m_WorkMask, m_Dest, &m_bStopRequest, &m_iProgressCounter,
-					&m_Slices,
-					s.alt_amplitude, s.amplitude, s.dl, s.gauss_prec, s.interpolation, s.fast_approx);
+
+			vector<AngleTaskAccumulator *> apAccumulators;
+			for(size_t i = 0; i < m_AngleTaskAccumulators.size(); ++i)
+				apAccumulators.push_back(&m_AngleTaskAccumulators[i]);
+			do_blur_anisotropic_reduce_angle_tasks(&apAccumulators[0], (int) apAccumulators.size(), m_Dest,
+					&m_Slices, s.tile_size, &m_bStopRequest);
+		}
+		else if(s.angle_scheduling == AlgorithmSettings::ANGLES_FUSED_TILES)
+		{
+			/* Each thread works on tiles with its own W, so we don't need m_G at all. */
+			if(iThreadNo == 0)
+			{
+				m_G.free();
+				m_Slices.Init(get_fused_tile_count(WalkImage, s.tile_size));
+			}
+			Synchronize();
+
+			do_blur_anisotropic_fused_tiles(WalkImage, m_G2, iTensorScale, WalkMask, m_Dest, &m_bStopRequest, &m_iProgressCounter,
+					&m_Slices, s.tile_size, bCompactW, CompactFormat, s.da,
+					s.alt_amplitude, s.amplitude, s.dl, s.gauss_prec, s.interpolation, s.fast_approx, s.simt_walk, s.fast_lic, bBidirectional);
+		}
+		else
+		{
+			if(iThreadNo == 0)
+			{
+				if(bCompactW)
+				{
+					m_G.free();
+					m_W.alloc(WalkImage.width, WalkImage.height, CompactFormat, s.dl);
+				}
+				else
+					m_G.alloc(WalkImage.width, WalkImage.height, 4);
+			}
+
+			/* FastLIC walks tiles instead of rows. */
+			const bool bFastLIC = o.m_bFastLIC && s.fast_approx;
+
+			int iStep = 0;
+			for(float theta=(360%(int)s.da)/2.0f; theta<fMaxTheta; theta += s.da)
+			{
+				const CImg &AngleMask = bAdaptiveAngles? get_adaptive_angle_mask(m_Angles, iStep++, WalkMask):WalkMask;
+				Synchronize();
+				if(iThreadNo == 0)
+					m_Slices.Init(WalkImage.height);
+				Synchronize();
+				if(bCompactW)
+					do_blur_anisotropic_init_for_angle(m_G2, iTensorScale, m_W, &m_bStopRequest, &m_iProgressCounter,
+						&m_Slices, theta, s.dl);
+				else
+					do_blur_anisotropic_init_for_angle(m_G2, iTensorScale, m_G, &m_bStopRequest, &m_iProgressCounter,
+						&m_Slices, theta, s.dl);
+
+				/* Run the blur. */
+				Synchronize();
+				if(iThreadNo == 0)
+				{
+					if(bFastLIC)
+						m_Slices.Init(get_fused_tile_count(WalkImage, s.tile_size));
+					else
+						m_Slices.Reset();
+				}
+				Synchronize();
+				if(bFastLIC)
+				{
+					if(bCompactW)
+						do_blur_anisotropic_fastlic_angle(WalkImage, m_W, WalkMask, m_Dest, &m_bStopRequest, &m_iProgressCounter,
+								&m_Slices, s.tile_size,
+								s.alt_amplitude, s.amplitude, s.dl, s.gauss_prec, s.interpolation, bBidirectional);
+					else
+						do_blur_anisotropic_fastlic_angle(WalkImage, m_G, WalkMask, m_Dest, &m_bStopRequest, &m_iProgressCounter,
+								&m_Slices, s.tile_size,
+								s.alt_amplitude, s.amplitude, s.dl, s.gauss_prec, s.interpolation, bBidirectional);
+				}
+				else if(bCompactW)
+					do_blur_anisotropic_with_vectors_angle(WalkImage, m_W, AngleMask, m_Dest, &m_bStopRequest, &m_iProgressCounter,
+							&m_Slices,
+							s.alt_amplitude, s.amplitude, s.dl, s.gauss_prec, s.interpolation, s.fast_approx, bBidirectional);
+				else
+					do_blur_anisotropic_with_vectors_angle(WalkImage, m_G, AngleMask, m_Dest, &m_bStopRequest, &m_iProgressCounter,
+							&m_Slices,
+							s.alt_amplitude, s.amplitude, s.dl, s.gauss_prec, s.interpolation, s.fast_approx, s.simt_walk, bBidirectional);
+			}
 		}
 		printf("Timing: main %f\n", gettime() - tt);
 
@@ -426,9 +825,86 @@ void Algorithm::Denoise(int iThreadNo, int iIteraton)
 		/* Copy and scale the finished data back. */
 		Synchronize();
 		if(iThreadNo == 0)
-			m_Slices.Reset();
+			m_Slices.Init(WalkImage.height);
 		Synchronize();
-		do_blur_anisotropic_finalize(m_Dest, m_WorkImage, N, m_WorkMask, &m_Slices, &m_bStopRequest);
+		/* Measure the change unless this is the last iteration.  Each thread sums its own rows.
+		 * In luma/chroma mode, WalkImage is only luma, so measure the merged image instead. */
+		const bool bMeasureChange = s.convergence_tolerance > 0 && iIteraton+1 < s.iterations;
+		BlockChange Change = m_BlockChange;
+		Change.fSumSquares = 0;
+		Change.iSamples = 0;
+		BlockChange *pFinalizeChange = bMeasureChange && !m_bLumaChroma? &Change:NULL;
+
+		if(m_bFlatActive)
+			do_blur_anisotropic_finalize_flat(m_Dest, WalkImage, N, bAdaptiveAngles? &m_Angles:NULL, m_WorkMask, m_Flat, m_G2, iTensorScale, &m_Slices, &m_bStopRequest,
+				pFinalizeChange);
+		else
+			do_blur_anisotropic_finalize(m_Dest, WalkImage, N, bAdaptiveAngles? &m_Angles:NULL, m_WorkMask, &m_Slices, &m_bStopRequest,
+				pFinalizeChange);
+
+		if(m_bLumaChroma)
+		{
+			/* Walk chroma at half resolution, with G2 averaged down and twice da.  The walk's
+			 * length is in chroma pixels, so a quarter of the amplitude covers the same
+			 * distance.  Chroma doesn't use flat regions or count toward progress. */
+			const float fChromaDa = s.da * 2;
+			const bool bChromaBidirectional = s.bidirectional && angles_have_opposites(fChromaDa);
+			int iChromaAngles = 0;
+			for(float theta=(360%(int)fChromaDa)/2.0f; theta<360; theta += fChromaDa)
+				++iChromaAngles;
+
+			Synchronize();
+			if(iThreadNo == 0)
+			{
+				m_ChromaG2.alloc(m_Chroma.width, m_Chroma.height, 4);
+				m_ChromaW.alloc(m_Chroma.width, m_Chroma.height, 4);
+				m_ChromaDest.alloc(m_Chroma.width, m_Chroma.height, 2);
+				m_ChromaDest.fill(0);
+				m_Slices.Init(m_Chroma.height);
+			}
+			Synchronize();
+			get_half_tensor(m_G2, iTensorScale, WalkImage.width, WalkImage.height, m_ChromaG2, &m_Slices, &m_bStopRequest);
+
+			for(float theta=(360%(int)fChromaDa)/2.0f; theta<(bChromaBidirectional? 180.0f:360.0f); theta += fChromaDa)
+			{
+				Synchronize();
+				if(iThreadNo == 0)
+					m_Slices.Init(m_Chroma.height);
+				Synchronize();
+				do_blur_anisotropic_init_for_angle(m_ChromaG2, 1, m_ChromaW, &m_bStopRequest, NULL,
+					&m_Slices, theta, s.dl);
+
+				Synchronize();
+				if(iThreadNo == 0)
+					m_Slices.Reset();
+				Synchronize();
+				do_blur_anisotropic_with_vectors_angle(m_Chroma, m_ChromaW, m_ChromaMask, m_ChromaDest, &m_bStopRequest, NULL,
+						&m_Slices,
+						s.alt_amplitude, s.amplitude / 4, s.dl, s.gauss_prec, s.interpolation, s.fast_approx, s.simt_walk, bChromaBidirectional);
+			}
+
+			Synchronize();
+			if(iThreadNo == 0)
+				m_Slices.Init(m_Chroma.height);
+			Synchronize();
+			do_blur_anisotropic_finalize(m_ChromaDest, m_Chroma, iChromaAngles, NULL, m_ChromaMask, &m_Slices, &m_bStopRequest, NULL);
+
+			/* Convert back into m_WorkImage. */
+			Synchronize();
+			if(iThreadNo == 0)
+				m_Slices.Init(m_WorkImage.height);
+			Synchronize();
+			do_luma_chroma_merge(m_Luma, m_Chroma, m_SourceImage.m_iChannels, m_WorkMask, m_WorkImage,
+				&m_Slices, &m_bStopRequest, bMeasureChange? &Change:NULL);
+		}
+
+		if(bMeasureChange)
+		{
+			m_ProcessingMutex.Lock();
+			m_BlockChange.fSumSquares += Change.fSumSquares;
+			m_BlockChange.iSamples += Change.iSamples;
+			m_ProcessingMutex.Unlock();
+		}
 	}
 
 	Synchronize();
@@ -442,6 +918,10 @@ void Algorithm::RunDenoise(int iThreadNo)
 	// XXX
 	if (s.dl<0 || s.da<0 || s.gauss_prec<0)
 		throw Exception("dl>0, da>0, gauss_prec>0");
+	if (s.tile_size < 1)
+		throw Exception("tile_size>0");
+	if (s.tensor_scale < 0)
+		throw Exception("tensor_scale>=0");
 
 	/* Initialize thread synchronization. */
 	m_ProcessingMutex.Lock();
@@ -461,6 +941,16 @@ void Algorithm::RunDenoise(int iThreadNo)
 	m_ProcessingMutex.Unlock();
 	Synchronize();
 
+	if(!m_aSweepVariants.empty())
+	{
+		RunSweep(iThreadNo);
+		return;
+	}
+
+	/* Fused iterations need the overlap to grow with the iterations, so they're CPU only; the
+	 * GPU path limits blocks to 4096 pixels including the overlap. */
+	const bool bFuseIterations = s.fuse_iterations && !o.m_bGPU && s.iterations > 1;
+
 	int iMaxBlockWidth, iMaxBlockHeight, iOverlapPixels; // valid on thread 0 only
 	if(iThreadNo == 0)
 	{
@@ -475,50 +965,259 @@ void Algorithm::RunDenoise(int iThreadNo)
 		 * past the actual area we're processing where we may blur data from. */
 		iOverlapPixels = min((int) length, 100); /* tolerate large aplitude values */
 
+		/* Each iteration blurs data in from up to length farther away.  Past a few iterations,
+		 * that's too little to be worth processing the larger blocks. */
+		if(bFuseIterations)
+			iOverlapPixels = min((int) length * s.iterations, 300);
+
 		m_ProcBlocks.SetLimitTo4096(GetOptions().m_bGPU);
 		m_ProcBlocks.LoadFromSourceImage(m_SourceImage, iOverlapPixels);
 		m_ProcBlocks.DeleteMaskedBlocks(m_Mask);
 
+		/* In luma/chroma mode, m_Dest holds luma: Y and any channels after RGB. */
+		m_bLumaChroma = s.luma_chroma && !o.m_bGPU && m_SourceImage.m_iChannels >= 3;
 		if(!o.m_bGPU)
-			m_Dest.alloc(m_ProcBlocks.GetMaxBlockWidth(), m_ProcBlocks.GetMaxBlockHeight(), GetProcessedChannels());
+			m_Dest.alloc(m_ProcBlocks.GetMaxBlockWidth(), m_ProcBlocks.GetMaxBlockHeight(),
+				m_bLumaChroma? m_SourceImage.m_iChannels - 2:GetProcessedChannels());
 	}
 	Synchronize();
 
 	if(iThreadNo == 0)
 	{
-		for(int i = 0; i < s.iterations; ++i)
+		m_aiBlockIterations.assign(m_ProcBlocks.GetTotalBlocks(), 0);
+		m_abBlockConverged.assign(m_ProcBlocks.GetTotalBlocks(), false);
+
+		/* The RMS change is in the image's units, and the tolerance is in 8-bit levels. */
+		const float fTolerance = s.convergence_tolerance * (m_SourceImage.m_iBytesPerChannel > 1? 257:1);
+
+		if(bFuseIterations)
 		{
+			/* Every block reads the original source, so the overlaps only need saving once.  The
+			 * block stays in m_WorkImage between iterations, and is stored once at the end. */
 			m_ProcBlocks.SaveOverlaps();
 
 			for(size_t iBlock = 0; iBlock < m_ProcBlocks.GetTotalBlocks(); ++iBlock)
 			{
-				m_ProcBlocks.GetBlock(m_WorkImage, iBlock, GetProcessedChannels());
+				for(int i = 0; i < s.iterations; ++i)
+					DenoiseBlock((int) iBlock, i, i == 0, false, fTolerance);
+				m_ProcBlocks.StoreBlock(m_WorkImage, iBlock);
+			}
+		}
+		else
+		{
+			for(int i = 0; i < s.iterations; ++i)
+			{
+				m_ProcBlocks.SaveOverlaps();
 
-				if(!m_Mask.Empty())
-					m_ProcBlocks.GetBlockMask(m_WorkMask, m_Mask, iBlock);
+				for(size_t iBlock = 0; iBlock < m_ProcBlocks.GetTotalBlocks(); ++iBlock)
+					DenoiseBlock((int) iBlock, i, true, true, fTolerance);
+			}
+		}
+	}
+	else
+	{
+		/* Follow thread 0 through the same blocks and iterations, in the same order. */
+		const int iBlocks = (int) m_ProcBlocks.GetTotalBlocks();
+		for(int iStep = 0; iStep < s.iterations * iBlocks; ++iStep)
+		{
+			const int i = bFuseIterations? iStep % s.iterations:iStep / iBlocks;
 
-				/* Run the filter. */
-				Synchronize();
+			/* Wait for thread 0 to handle setup. */
+			Synchronize();
+			if(!m_bSkipBlock)
 				Denoise(iThreadNo, i);
-				Synchronize();
+			Synchronize();
+		}
+	}
+}
 
-				m_ProcBlocks.StoreBlock(m_WorkImage, iBlock);
+/* Run iteration iIteration of a block, on thread 0 while the other threads run Denoise.  If bLoad
+ * is true, load the block into m_WorkImage first; if bStore is true, store it afterwards. */
+void Algorithm::DenoiseBlock(int iBlock, int iIteration, bool bLoad, bool bStore, float fTolerance)
+{
+	/* Skip blocks that have converged, counting their progress as done. */
+	m_bSkipBlock = m_abBlockConverged[iBlock];
+	if(m_bSkipBlock)
+	{
+		InterlockedExchangeAdd(&m_iProgressCounter, (LONG) (m_ProcBlocks.GetBlockRows(iBlock) * GetProgressPerRow()));
+		Synchronize();
+		Synchronize();
+		return;
+	}
+
+	if(bLoad)
+	{
+		m_ProcBlocks.GetBlock(m_WorkImage, iBlock, GetProcessedChannels());
+
+		if(!m_Mask.Empty())
+			m_ProcBlocks.GetBlockMask(m_WorkMask, m_Mask, iBlock);
+	}
+
+	m_ProcBlocks.GetBlockRegion(iBlock, m_BlockChange.l, m_BlockChange.t, m_BlockChange.width, m_BlockChange.height);
+	m_BlockChange.fSumSquares = 0;
+	m_BlockChange.iSamples = 0;
+
+	/* Run the filter. */
+	Synchronize();
+	Denoise(0, iIteration);
+	Synchronize();
+
+	if(bStore)
+		m_ProcBlocks.StoreBlock(m_WorkImage, iBlock);
+	++m_aiBlockIterations[iBlock];
+
+	if(m_BlockChange.iSamples > 0)
+	{
+		const float fRMS = (float) sqrt(m_BlockChange.fSumSquares / m_BlockChange.iSamples);
+		if(fRMS < fTolerance)
+			m_abBlockConverged[iBlock] = true;
+	}
+}
+
+/* Run the parameter sweep set by SetSweep.  Each block is loaded once, and each tensor group
+ * prepares it once. */
+void Algorithm::RunSweep(int iThreadNo)
+{
+	if(iThreadNo == 0)
+	{
+		/* Overlap enough for the longest streamline of any variant; see RunDenoise. */
+		float fMaxLength = 0;
+		for(size_t i = 0; i < m_aSweepVariants.size(); ++i)
+		{
+			const AlgorithmSettings &v = m_aSweepVariants[i];
+			fMaxLength = max(fMaxLength, v.gauss_prec * 2 * sqrtf(2*v.amplitude));
+		}
+
+		m_ProcBlocks.SetLimitTo4096(false);
+		m_ProcBlocks.LoadFromSourceImage(m_SourceImage, min((int) fMaxLength, 100));
+		m_ProcBlocks.DeleteMaskedBlocks(m_Mask);
+		m_ProcBlocks.SaveOverlaps();
+	}
+	Synchronize();
+
+	for(size_t iBlock = 0; iBlock < m_ProcBlocks.GetTotalBlocks(); ++iBlock)
+	{
+		if(iThreadNo == 0)
+		{
+			m_ProcBlocks.GetBlock(m_SweepSource, (int) iBlock, GetProcessedChannels());
+			if(!m_Mask.Empty())
+				m_ProcBlocks.GetBlockMask(m_WorkMask, m_Mask, (int) iBlock);
+
+			/* If the mask is all-on, clear it, as in Denoise. */
+			bool bMaskIsUsed = false;
+			cimgIM_forXY(m_WorkMask, x, y)
+			{
+				if(!m_WorkMask(x,y))
+				{
+					bMaskIsUsed = true;
+					break;
+				}
 			}
+			if(!bMaskIsUsed)
+				m_WorkMask.Free();
 		}
+		Synchronize();
+
+		for(size_t iGroup = 0; iGroup < m_aSweepGroups.size(); ++iGroup)
+			SweepTensorGroup(iThreadNo, (int) iBlock, iGroup);
 	}
-	else
+}
+
+/* Prepare the current block for one tensor group, and render each of its variants.  This is
+ * Denoise with one ANGLES_PER_PASS walk per variant, sharing each angle's W within a walk group. */
+void Algorithm::SweepTensorGroup(int iThreadNo, int iBlock, size_t iGroup)
+{
+	const AlgorithmOptions &o = GetOptions();
+	const SweepGroup &Group = m_aSweepGroups[iGroup];
+	const AlgorithmSettings &g = m_aSweepVariants[Group.aaiWalkGroups[0][0]];
+	const int iTensorScale = g.tensor_scale > 0? g.tensor_scale:get_auto_tensor_scale(g.sigma);
+
+	if(iThreadNo == 0)
+		m_WorkImage.assign(m_SweepSource);
+
+	double tt = gettime();
+	Prep(iThreadNo, g, g.m_fPreBlur, iTensorScale);
+	if(iThreadNo == 0)
+	{
+		printf("Timing: sweep prep %f\n", gettime() - tt);
+
+		m_G2.alloc(m_G.width, m_G.height, 4);
+		m_G2.fill(0);
+		m_Slices.Init(m_G.height);
+	}
+	Synchronize();
+
+	do_blur_anisotropic(m_G, m_G2, &m_bStopRequest, &m_iProgressCounter, &m_Slices, g.sharpness, g.anisotropy, o.m_bSIMD,
+		m_WorkMask, NULL, NULL, iTensorScale);
+
+	for(size_t iWalk = 0; iWalk < Group.aaiWalkGroups.size(); ++iWalk)
 	{
-		for(int i = 0; i < s.iterations; ++i)
+		const vector<int> &aiVariants = Group.aaiWalkGroups[iWalk];
+		const AlgorithmSettings &w = m_aSweepVariants[aiVariants[0]];
+
+		int N = 0;
+		for(float theta=(360%(int)w.da)/2.0f; theta<360; theta += w.da)
+			++N;
+
+		const bool bBidirectional = w.bidirectional && angles_have_opposites(w.da);
+		const float fMaxTheta = bBidirectional? 180.0f:360.0f;
+
+		Synchronize();
+		if(iThreadNo == 0)
 		{
-			for(size_t iBlock = 0; iBlock < m_ProcBlocks.GetTotalBlocks(); ++iBlock)
+			m_G.alloc(m_WorkImage.width, m_WorkImage.height, 4);
+			if(m_aSweepDest.size() < aiVariants.size())
+				m_aSweepDest.resize(aiVariants.size());
+			for(size_t i = 0; i < aiVariants.size(); ++i)
 			{
-				/* Wait for thread 0 to handle setup. */
+				m_aSweepDest[i].alloc(m_WorkImage.width, m_WorkImage.height, m_WorkImage.dim);
+				m_aSweepDest[i].fill(0);
+			}
+		}
+
+		/* Compute each angle's W once, and walk it for every variant. */
+		double tt = gettime();
+		for(float theta=(360%(int)w.da)/2.0f; theta<fMaxTheta; theta += w.da)
+		{
+			Synchronize();
+			if(iThreadNo == 0)
+				m_Slices.Init(m_WorkImage.height);
+			Synchronize();
+			do_blur_anisotropic_init_for_angle(m_G2, iTensorScale, m_G, &m_bStopRequest, &m_iProgressCounter,
+				&m_Slices, theta, w.dl);
+
+			for(size_t i = 0; i < aiVariants.size(); ++i)
+			{
+				const AlgorithmSettings &v = m_aSweepVariants[aiVariants[i]];
 				Synchronize();
-				Denoise(iThreadNo, i);
+				if(iThreadNo == 0)
+					m_Slices.Reset();
 				Synchronize();
+				do_blur_anisotropic_with_vectors_angle(m_WorkImage, m_G, m_WorkMask, m_aSweepDest[i], &m_bStopRequest, &m_iProgressCounter,
+						&m_Slices,
+						v.alt_amplitude, v.amplitude, v.dl, v.gauss_prec, v.interpolation, v.fast_approx, v.simt_walk, bBidirectional);
 			}
 		}
+		if(iThreadNo == 0)
+			printf("Timing: sweep walk (%i variants) %f\n", (int) aiVariants.size(), gettime() - tt);
+
+		/* Finish each variant, and store it into its target. */
+		for(size_t i = 0; i < aiVariants.size(); ++i)
+		{
+			Synchronize();
+			if(iThreadNo == 0)
+			{
+				m_SweepResult.assign(m_WorkImage);
+				m_Slices.Init(m_WorkImage.height);
+			}
+			Synchronize();
+			do_blur_anisotropic_finalize(m_aSweepDest[i], m_SweepResult, N, NULL, m_WorkMask, &m_Slices, &m_bStopRequest, NULL);
+			Synchronize();
+			if(iThreadNo == 0)
+				m_ProcBlocks.StoreBlock(m_SweepResult, iBlock, *m_apSweepTargets[aiVariants[i]]);
+		}
 	}
+	Synchronize();
 }
 
 void Algorithm::thread_main(int iThreadNo)
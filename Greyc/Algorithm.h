@@ -3,6 +3,8 @@
 
 #include "CImgI.h"
 #include "GreycGPU.h"
+#include "GreycC.h"
+#include "GaussianBlur.h"
 #include "Threads.h"
 #include "Helpers.h"
 #include "AlgorithmShared.h"
@@ -25,6 +27,17 @@ struct Algorithm
 	void SetCallbacks(auto_ptr<Callbacks> pCallbacks) { m_pCallbacks = pCallbacks; }
 	void SetTarget(const CImg &image);
 	void SetMask(const CImg &mask);
+
+	/* Render a parameter sweep: on the next Run(), render the target once for each of aVariants,
+	 * into the matching image of apTargets instead of the target, which isn't changed.  The
+	 * targets are held like the target, and must be its size and format.  Variants with the same settings for
+	 * the prep and tensor stages share them, and variants that also have the same da, dl and
+	 * bidirectional share each angle's W.  The sweep runs on the CPU, and each variant must have a single
+	 * iteration, W_FLOAT, ANGLES_PER_PASS, and no flat regions, adaptive angles, FastLIC,
+	 * luma/chroma mode or partial stage output. */
+	void SetSweep(const vector<AlgorithmSettings> &aVariants, const vector<CImg *> &apTargets);
+	void ClearSweep();
+
 	void Run();
 
 	/* True if we've finished running, either successfully or with an error.  Once set, this remains
@@ -32,6 +45,10 @@ struct Algorithm
 	bool GetFinished() const { return m_bFinished; }
 	bool GetError(string &sError);
 	float Progress() const;
+
+	/* The number of iterations each block ran, which is less than iterations for blocks that
+	 * converged early.  Valid once we've finished. */
+	const vector<int> &GetBlockIterations() const { return m_aiBlockIterations; }
 	void Abort();
 
 protected:
@@ -45,8 +62,13 @@ protected:
 	static DWORD WINAPI algorithm_primary_thread(void *arg);
 	static DWORD WINAPI algorithm_thread(void *arg);
 	void Synchronize();
+	void Prep(int iThreadNo, const AlgorithmSettings &s, float fPreBlur, int iTensorScale);
 	void Denoise(int iThreadNo, int iIteraton);
+	void DenoiseBlock(int iBlock, int iIteration, bool bLoad, bool bStore, float fTolerance);
 	void RunDenoise(int iThreadNo);
+	void RunSweep(int iThreadNo);
+	void SweepTensorGroup(int iThreadNo, int iBlock, size_t iGroup);
+	float GetProgressPerRow() const;
 	void thread_main(int iThreadNo);
 	int GetProcessedChannels() const;
 
@@ -60,7 +82,20 @@ protected:
 	CImg m_WorkMask;
 	CImgF m_G;
 	CImgF m_G2;
+	CImgW m_W; /* W, if w_format isn't W_FLOAT; otherwise m_G is used */
 	CImgF m_Dest;
+	FlatRegions m_Flat; /* if flat_threshold is set */
+	bool m_bFlatActive; /* if m_Flat.Weight is the walk's mask */
+	AdaptiveAngles m_Angles; /* if adaptive_angles is set */
+	vector<AngleTaskAccumulator> m_AngleTaskAccumulators; /* one per group of angles, for ANGLES_TASKS */
+	BlockChange m_BlockChange; /* the change to the current block, if convergence_tolerance is set */
+	bool m_bLumaChroma; /* if luma_chroma is set and applies to this image */
+	CImgF m_Luma; /* the walked image in luma/chroma mode: Y and any channels after RGB */
+	CImgF m_Chroma; /* Cb and Cr at half size, in luma/chroma mode */
+	CImgF m_ChromaG2, m_ChromaW, m_ChromaDest; /* G2, W and dest for the chroma walk */
+	CImg m_ChromaMask;
+	GaussianBlurPasses m_PreBlur; /* the pre-blur's buffers, during Prep */
+	float m_fPrepMin, m_fPrepMax; /* the range of the blurred image, for normalizing in Prep */
 
 	Slices m_Slices;
 	mutable Mutex m_ProcessingMutex;
@@ -89,6 +124,22 @@ protected:
 	string m_sError;
 
 	Blocks m_ProcBlocks;
+	vector<int> m_aiBlockIterations;
+	vector<bool> m_abBlockConverged;
+	bool m_bSkipBlock; /* set by thread 0 if the current block has converged */
+
+	/* The parameter sweep, if any; see SetSweep.  Each tensor group is the variants that share
+	 * the prep and tensor stages, split into walk groups that also share W. */
+	struct SweepGroup
+	{
+		vector<vector<int> > aaiWalkGroups;
+	};
+	vector<AlgorithmSettings> m_aSweepVariants;
+	vector<CImg *> m_apSweepTargets;
+	vector<SweepGroup> m_aSweepGroups;
+	CImgF m_SweepSource; /* the current block, before any variant is applied */
+	CImgF m_SweepResult;
+	vector<CImgF> m_aSweepDest; /* one per variant of the current walk group */
 
 	mutable float fStartedAt; // debug/timing
 };
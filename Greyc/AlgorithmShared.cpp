@@ -18,11 +18,23 @@ AlgorithmSettings::AlgorithmSettings()
 	dl = 0.8f;
 	da = 30.0f;
 	gauss_prec = 2.0f;
+	flat_threshold = 0;
+	adaptive_angles = 0;
 	interpolation = 0;
 	partial_stage_output = 0;
 	iterations = 1;
+	convergence_tolerance = 0;
+	fuse_iterations = false;
 	fast_approx = true;
 	alt_amplitude = true;
+	fast_lic = false;
+	simt_walk = false;
+	bidirectional = false;
+	w_format = W_FLOAT;
+	angle_scheduling = ANGLES_PER_PASS;
+	tile_size = 128;
+	tensor_scale = 1;
+	luma_chroma = false;
 }
 
 string AlgorithmSettings::GetAsString() const
@@ -42,11 +54,18 @@ string AlgorithmSettings::GetAsString() const
 	TO_STR(sigma, "-sigma", 3);
 	TO_STR(m_fPreBlur, "-gauss", 3);
 	TO_STR(iterations, "-iter", 3);
+	TO_STR(convergence_tolerance, "-tol", 3);
 	TO_STR(gfact, "-fact", 3);
 	TO_STR(dl, "-dl", 3);
 	TO_STR(da, "-da", 3);
 	TO_STR(gauss_prec, "-prec", 3);
+	TO_STR(flat_threshold, "-flat", 3);
+	TO_STR(adaptive_angles, "-adaptive", 3);
 	TO_STR(interpolation, "-interp", 3);
+	TO_STR(w_format, "-wformat", 3);
+	TO_STR(angle_scheduling, "-schedule", 3);
+	TO_STR(tile_size, "-tile", 3);
+	TO_STR(tensor_scale, "-tensorscale", 3);
 	if(fast_approx)
 	{
 		if(!sBuf.empty()) sBuf += " ";
@@ -57,6 +76,31 @@ string AlgorithmSettings::GetAsString() const
 		if(!sBuf.empty()) sBuf += " ";
 		sBuf += "-alt";
 	}
+	if(fast_lic)
+	{
+		if(!sBuf.empty()) sBuf += " ";
+		sBuf += "-fastlic";
+	}
+	if(simt_walk)
+	{
+		if(!sBuf.empty()) sBuf += " ";
+		sBuf += "-simt";
+	}
+	if(bidirectional)
+	{
+		if(!sBuf.empty()) sBuf += " ";
+		sBuf += "-bidir";
+	}
+	if(fuse_iterations)
+	{
+		if(!sBuf.empty()) sBuf += " ";
+		sBuf += "-fuse";
+	}
+	if(luma_chroma)
+	{
+		if(!sBuf.empty()) sBuf += " ";
+		sBuf += "-lumachroma";
+	}
 	return sBuf;
 }
 
@@ -65,5 +109,6 @@ AlgorithmOptions::AlgorithmOptions()
 	nb_threads = 0;
 	m_DisplayMode = DISPLAY_SINGLE;
 	m_bGPU = true;
+	m_bSIMD = true;
 }
 
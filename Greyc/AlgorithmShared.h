@@ -21,11 +21,94 @@ struct AlgorithmSettings
 	float dl;
 	float da;
 	float gauss_prec;
+
+	/* If positive, pixels with a gradient below half of this are blurred with a Gaussian
+	 * instead of being walked, and pixels up to this blend the two.  See
+	 * do_blur_anisotropic_classify_row.  The GPU path ignores this. */
+	float flat_threshold;
+
+	/* If positive, pixels whose G2 is at least this isotropic walk only every other angle, and
+	 * pixels more isotropic still every fourth.  See do_blur_anisotropic_classify_angles_row.
+	 * The GPU path ignores this, as do fused tiles, angle tasks and FastLIC. */
+	float adaptive_angles;
+
 	unsigned int interpolation;
 	__int32 partial_stage_output;
 	__int32 iterations;
+
+	/* If positive, a block stops iterating once an iteration changes it by less than this, as an
+	 * RMS difference in 8-bit levels.  The GPU path ignores this. */
+	float convergence_tolerance;
+
+	/* If true, run every iteration on a block before moving on to the next, keeping the block
+	 * in floating point in between, instead of storing each iteration back to the document.  The
+	 * overlap around each block grows with the number of iterations.  This skips the quantization
+	 * between iterations, so the output differs slightly (and is closer to the exact result).
+	 * The GPU path ignores this. */
+	bool fuse_iterations;
+
 	bool fast_approx;
 	bool alt_amplitude;
+
+	/* If true and fast_approx is set, the CPU path shares samples between the pixels along each
+	 * streamline (FastLIC), instead of walking from every pixel.  This is an approximation: the
+	 * output differs slightly from the per-pixel walk.  See do_blur_anisotropic_fastlic_tile.
+	 * The GPU path ignores this. */
+	bool fast_lic;
+
+	/* If true, the CPU path walks 8 or 16 streamlines at once with AVX2 or AVX-512, when the
+	 * CPU supports it; see do_blur_anisotropic_with_vectors_row_simt.  With alt_amplitude, its
+	 * Gaussian weights differ from expf by a couple of ulp, so the output differs slightly.
+	 * This only applies to W_FLOAT.  The GPU path ignores this. */
+	bool simt_walk;
+
+	/* If true and every angle's opposite is also walked (see angles_have_opposites), the CPU path
+	 * computes W once for each pair of opposite angles, and walks each pixel's streamline both
+	 * ways from it.  The angles are added up in a different order, so the output differs
+	 * slightly.  The GPU path ignores this. */
+	bool bidirectional;
+
+	/* How the CPU path stores the per-angle vector field W.  The compact formats use 6 bytes
+	 * per pixel instead of 16, at a small cost in precision.  W_HALF needs F16C, and falls
+	 * back on W_FIXED without it.  The GPU path ignores this. */
+	enum WFormat
+	{
+		W_FLOAT,
+		W_HALF,
+		W_FIXED
+	};
+
+	WFormat w_format;
+
+	/* How the CPU path schedules the angle passes.  The schedules add up the angles in different
+	 * orders, so the output differs slightly between them; fused tiles also cut off streamlines
+	 * at the tile halo (see do_blur_anisotropic_fused_tiles).  ANGLES_TASKS uses fewer groups
+	 * of angles than threads if its accumulators would take too much memory, which changes the
+	 * order of the sums.  The GPU path ignores this. */
+	enum AngleScheduling
+	{
+		ANGLES_PER_PASS,	/* one pass over the whole block per angle */
+		ANGLES_FUSED_TILES,	/* every angle for one tile at a time; see do_blur_anisotropic_fused_tiles */
+		ANGLES_TASKS		/* each group of angles over a band of rows is a task; see do_blur_anisotropic_angle_tasks */
+	};
+
+	AngleScheduling angle_scheduling;
+
+	/* The tile size, in pixels, for ANGLES_FUSED_TILES and FastLIC, and the band height for
+	 * ANGLES_TASKS.  Streamlines are cut off at the edges of fused tiles and FastLIC claims
+	 * pixels a tile at a time, so this affects their output. */
+	int tile_size;
+
+	/* If 2 or 4, the CPU path builds the structure tensors at 1/2 or 1/4 resolution, and samples
+	 * them bilinearly when building W; see get_tensor_row.  This is an approximation.  If 0,
+	 * choose from sigma; see get_auto_tensor_scale.  1 is full resolution.  The GPU path and
+	 * partial stage output ignore this. */
+	int tensor_scale;
+
+	/* If true, RGB is smoothed as luma at full resolution and chroma at half resolution with
+	 * twice da; see do_luma_chroma_split.  The GPU path and images with fewer than three
+	 * channels ignore this. */
+	bool luma_chroma;
 };
 
 /* Options are configuration that don't affect the output. */
@@ -39,6 +122,9 @@ struct AlgorithmOptions
 
 	bool m_bGPU;
 
+	/* If false, use the scalar reference code instead of the SSE/AVX kernels, for comparison. */
+	bool m_bSIMD;
+
 	enum DisplayMode
 	{
 		DISPLAY_SINGLE,
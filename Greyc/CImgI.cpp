@@ -23,7 +23,7 @@ CImgF::CImgF()
 void CImgF::free()
 {
 	if(owned)
-		delete[] real_data;
+		delete[] (float *) real_data;
 	width = height = dim = stride = 0;
 	data = NULL;
 	real_data = NULL;
@@ -70,7 +70,7 @@ void CImgF::alloc(int iWidth, int iHeight, int iBytesPerPixel, int iStride)
 	if(iSize != size())
 	{
 		if(owned)
-			delete[] real_data;
+			delete[] (float *) real_data;
 		data = NULL;
 		real_data = NULL;
 		data = aligned_alloc(iSize, &real_data);
@@ -136,17 +136,15 @@ void CImgF::maxmin(float &fMin, float &fMax) const
 
 bool CImgF::sse_compatible() const
 {
-#if defined(_WIN64)
-        return true;
-#else
+#if !defined(_WIN64)
 	if(!(GetCPUID() & CPUID_SSE))
 		return false;
+#endif
 	if(dim != 4)
 		return false;
 	if(stride & 0x3) // not aligned
 		return false;
 	return true;
-#endif
 }
 
 void CImgF::normalize(const float a, const float b)
@@ -166,7 +164,7 @@ void CImgF::normalize(const float a, const float b)
 			*ptr = (*ptr-fm)/(fM-fm)*(b-a)+a;
 }
 
-void CImgF::alias(const CImgF &img, int iX, int iY, int iWidth)
+void CImgF::alias(const CImgF &img, int /* iX */, int /* iY */, int /* iWidth */)
 {
 	width = img.width;
 	height = img.height;
@@ -182,7 +180,6 @@ void CImgF::assign(const float *pBuffer, int iWidth, int iHeight, int iChannels,
 	if(iStride == -1)
 		iStride = align(iWidth * iChannels, 4);
 	const int siz = iHeight*iStride;
-	const int curr_siz = size();
 	if(pBuffer+siz<data || pBuffer>=data+size())
 	{
 		alloc(iWidth, iHeight, iChannels, iStride);
@@ -191,7 +188,7 @@ void CImgF::assign(const float *pBuffer, int iWidth, int iHeight, int iChannels,
 		void *new_real_data;
 		float *new_data = aligned_alloc(siz, &new_real_data);
 		memcpy(new_data, pBuffer, siz*sizeof(float));
-		delete[] real_data;
+		delete[] (float *) real_data;
 		data = new_data;
 		real_data = new_real_data;
 		width = iWidth; height = iHeight; dim = iChannels; stride = iStride;
@@ -467,6 +464,65 @@ float CImgF::linear_pix2d(const float fx, const float fy, const int v) const
 	return Icc + dx*(Inc-Icc + dy*(Icc+Inn-Icn-Inc)) + dy*(Icn-Icc);
 }
 
+CImgW::CImgW()
+{
+	data = NULL;
+	width = height = stride = 0;
+	format = FIXED;
+	owned = false;
+}
+
+CImgW::~CImgW()
+{
+	free();
+}
+
+void CImgW::free()
+{
+	if(owned)
+		delete[] data;
+	data = NULL;
+	width = height = stride = 0;
+	owned = false;
+}
+
+void CImgW::alloc(int iWidth, int iHeight, Format fmt, float dl)
+{
+	/* Pad each row by at least 2 bytes, so get() can read 8 bytes at the last pixel. */
+	const int iStride = align(iWidth * 6 + 2, 8);
+	if(!owned || iStride * iHeight != stride * height)
+	{
+		free();
+		data = new uint8_t[iStride * iHeight];
+		owned = true;
+	}
+
+	width = iWidth;
+	height = iHeight;
+	stride = iStride;
+	format = fmt;
+
+	/* u and v are at most dl long, and n is usually at most 1 and never more than 2. */
+	scale[0] = 1.0f / 8192;
+	scale[1] = scale[2] = dl / 32767;
+	scale[3] = 0;
+	scale_inv[0] = 8192;
+	scale_inv[1] = scale_inv[2] = 32767 / dl;
+	scale_inv[3] = 0;
+}
+
+void CImgW::Hold(const CImgW &rhs, int iWidth, int iHeight)
+{
+	free();
+	data = rhs.data;
+	width = min(iWidth, rhs.width);
+	height = min(iHeight, rhs.height);
+	stride = rhs.stride;
+	format = rhs.format;
+	memcpy(scale, rhs.scale, sizeof(scale));
+	memcpy(scale_inv, rhs.scale_inv, sizeof(scale_inv));
+}
+
 void CImg::CopyFrom(const CImg &source, int iSourceX, int iSourceY, int iDestX, int iDestY, int iWidth, int iHeight)
 {
 	if(source.m_iBytesPerChannel != m_iBytesPerChannel)
@@ -739,11 +795,15 @@ void Blocks::GetBlock(CImgF &WorkImage, int iBlock, int iChannels)
 void Blocks::GetBlockMask(CImg &WorkMask, CImg &SourceMask, int iBlock)
 {
 	const Rect &r = m_Blocks[iBlock];
-	const Rect &br = m_BlockRegion[iBlock];
 	WorkMask.Hold(SourceMask.ptr(r.l, r.t), r.width, r.height, 1, 1, SourceMask.m_iStrideBytes);
 }
 
 void Blocks::StoreBlock(const CImgF &WorkImage, int iBlock)
+{
+	StoreBlock(WorkImage, iBlock, m_SourceImage);
+}
+
+void Blocks::StoreBlock(const CImgF &WorkImage, int iBlock, const CImg &Target)
 {
 	const Rect &r = m_Blocks[iBlock];
 	const Rect &br = m_BlockRegion[iBlock];
@@ -753,7 +813,17 @@ void Blocks::StoreBlock(const CImgF &WorkImage, int iBlock)
 	int iLeftBuffer = r.l + br.l;
 
 	/* Copy the finished data back out. */
-	WorkImage.CopyTo(m_SourceImage, br.l, br.t, iLeftBuffer, iTopBuffer, br.width, br.height);
+	WorkImage.CopyTo(Target, br.l, br.t, iLeftBuffer, iTopBuffer, br.width, br.height);
+}
+
+/* Get the active region of a block, relative to the block. */
+void Blocks::GetBlockRegion(int iBlock, int &iLeft, int &iTop, int &iWidth, int &iHeight) const
+{
+	const Rect &br = m_BlockRegion[iBlock];
+	iLeft = br.l;
+	iTop = br.t;
+	iWidth = br.width;
+	iHeight = br.height;
 }
 
 int Blocks::GetTotalRows() const
@@ -2,7 +2,9 @@
 #define CIMGI_H
 
 #include <stdio.h>
+#include <string.h>
 #include <algorithm>
+#include <immintrin.h>
 #include "Helpers.h"
 using namespace std;
 
@@ -68,6 +70,45 @@ using namespace std;
 
 typedef unsigned char uint8_t;
 
+/*
+ * The four taps and weights of a bilinear sample, clamped to the edges of an image the same
+ * way as CImgF::linear_pix2d.  These only depend on the image size, so one set can be used to
+ * sample every channel, or several images of the same size.
+ */
+struct LinearTaps
+{
+	int x, y, nx, ny;
+	float dx, dy;
+
+	void set(const float fx, const float fy, const int iWidth, const int iHeight)
+	{
+		const float nfx = fx<0?0:(fx>iWidth-1?iWidth-1:fx);
+		const float nfy = fy<0?0:(fy>iHeight-1?iHeight-1:fy);
+		x = (int)nfx;
+		y = (int)nfy;
+		dx = nfx-x;
+		dy = nfy-y;
+		nx = dx>0?x+1:x;
+		ny = dy>0?y+1:y;
+	}
+
+	/* Offset the taps, to sample a window of a larger image. */
+	void offset(const int iX, const int iY)
+	{
+		x += iX; nx += iX;
+		y += iY; ny += iY;
+	}
+};
+
+/* Interpolate four pixels with the same arithmetic as CImgF::linear_pix2d. */
+static inline __m128 lerp_ps(const __m128 &Icc, const __m128 &Inc, const __m128 &Icn, const __m128 &Inn, const float dx, const float dy)
+{
+	const __m128 vdx = _mm_set1_ps(dx), vdy = _mm_set1_ps(dy);
+	__m128 r = _mm_add_ps(_mm_sub_ps(Inc, Icc), _mm_mul_ps(vdy, _mm_sub_ps(_mm_sub_ps(_mm_add_ps(Icc, Inn), Icn), Inc)));
+	r = _mm_add_ps(Icc, _mm_mul_ps(vdx, r));
+	return _mm_add_ps(r, _mm_mul_ps(vdy, _mm_sub_ps(Icn, Icc)));
+}
+
 class CImg;
 class CImgF
 {
@@ -129,12 +170,117 @@ public:
 
 	float linear_pix2d(const float fx, const float fy, const int v=0) const;
 
+	/* Sample channel v with precomputed taps.  This gives the same result as linear_pix2d. */
+	float linear_pix2d(const LinearTaps &t, const int v) const
+	{
+		const float Icc = (*this)(t.x,t.y,v);
+		const float Inc = (*this)(t.nx,t.y,v);
+		const float Icn = (*this)(t.x,t.ny,v);
+		const float Inn = (*this)(t.nx,t.ny,v);
+		return Icc + t.dx*(Inc-Icc + t.dy*(Icc+Inn-Icn-Inc)) + t.dy*(Icn-Icc);
+	}
+
+	/* Load the four taps of a four-channel image. */
+	void linear_taps_ps(const LinearTaps &t, __m128 I[4]) const
+	{
+		I[0] = _mm_load_ps(ptr(t.x,t.y));
+		I[1] = _mm_load_ps(ptr(t.nx,t.y));
+		I[2] = _mm_load_ps(ptr(t.x,t.ny));
+		I[3] = _mm_load_ps(ptr(t.nx,t.ny));
+	}
+
+	/* Sample all four channels of a four-channel image, with one load per tap. */
+	__m128 linear_pix2d_ps(const LinearTaps &t) const
+	{
+		__m128 I[4];
+		linear_taps_ps(t, I);
+		return lerp_ps(I[0], I[1], I[2], I[3], t.dx, t.dy);
+	}
+
 	void CopyFrom(const CImg &source, int iSourceX, int iSourceY, int iDestX, int iDestY, int iWidth, int iHeight);
 	void CopyTo(const CImg &source, int iSourceX, int iSourceY, int iDestX, int iDestY, int iWidth, int iHeight) const;
 
 private:
 };
 
+/*
+ * A compact W field for the streamline walk (see do_blur_anisotropic_init_for_angle).  Each
+ * pixel holds n, u and v as three 16-bit values, 6 bytes per pixel instead of the 16 used by a
+ * four-channel CImgF.  get() returns the values in the first three elements of an __m128.
+ *
+ * HALF stores half floats, and needs F16C.  FIXED stores u and v scaled to dl, and n with 13 bits
+ * of fraction; it only needs SSE2.
+ *
+ * Rows are padded, so each pixel can be read with a single 8-byte load.
+ */
+class CImgW
+{
+public:
+	enum Format { HALF, FIXED };
+
+	uint8_t *data;
+	int width;
+	int height;
+	int stride; /* in bytes */
+	Format format;
+	bool owned;
+
+	CImgW();
+	~CImgW();
+	void alloc(int iWidth, int iHeight, Format fmt, float dl);
+	void free();
+
+	/* Hold the top-left iWidth x iHeight of rhs. */
+	void Hold(const CImgW &rhs, int iWidth, int iHeight);
+
+	bool is_empty() const { return !(data && width && height); }
+
+	const uint8_t *ptr(const unsigned int x, const unsigned int y) const { return data + x*6 + y*stride; }
+	uint8_t *ptr(const unsigned int x, const unsigned int y) { return data + x*6 + y*stride; }
+
+	/* Return n, u, v, 0 at x, y. */
+	__m128 get(const unsigned int x, const unsigned int y) const
+	{
+		const __m128i i = _mm_loadl_epi64((const __m128i *) ptr(x,y));
+		if(format == HALF)
+			return half_to_ps(i);
+		return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(i, i), 16)), _mm_loadu_ps(scale));
+	}
+
+	/* Store n, u, v, ignoring the fourth element. */
+	void set(const unsigned int x, const unsigned int y, __m128 val)
+	{
+		__m128i i;
+		if(format == HALF)
+			i = ps_to_half(val);
+		else
+		{
+			/* Don't let n round to zero; the walk divides by it with alt_amplitude. */
+			i = _mm_cvtps_epi32(_mm_mul_ps(val, _mm_loadu_ps(scale_inv)));
+			i = _mm_packs_epi32(i, i);
+			i = _mm_max_epi16(i, _mm_setr_epi16(1, -32767, -32767, 0, 0, 0, 0, 0));
+		}
+
+		const int iLow = _mm_cvtsi128_si32(i);
+		const short iHigh = (short) _mm_extract_epi16(i, 2);
+		uint8_t *p = ptr(x,y);
+		memcpy(p, &iLow, sizeof(iLow));
+		memcpy(p+4, &iHigh, sizeof(iHigh));
+	}
+
+private:
+	/* HALF only, so only reached with SIMD_F16C. */
+	static SIMD_TARGET_F16C __m128 half_to_ps(__m128i i) { return _mm_cvtph_ps(i); }
+	static SIMD_TARGET_F16C __m128i ps_to_half(__m128 val) { return _mm_cvtps_ph(val, 0); }
+
+	/* FIXED only: the value of one unit of each channel, and its inverse.  These aren't __m128,
+	 * since we may not be allocated 16-byte aligned. */
+	float scale[4], scale_inv[4];
+
+	CImgW(const CImgW &cpy);
+	CImgW &operator=(const CImgW &rhs);
+};
+
 /* A simple wrapper for integer images.  This is mostly just enough to hold an
  * image, and to blit between each other and CImgF.  The heavy lifting is all
  * done in CImgF. */
@@ -188,10 +334,16 @@ public:
 	void GetBlockMask(CImg &WorkMask, CImg &SourceMask, int iBlock);
 	void StoreBlock(const CImgF &WorkImage, int iBlock);
 
+	/* Store the block into Target instead of the source image.  Target must be the same size
+	 * and format as the source. */
+	void StoreBlock(const CImgF &WorkImage, int iBlock, const CImg &Target);
+
 	/* Get the total number of rows represented by m_Blocks, for Progress: */
 	int GetTotalRows() const;
 	int GetTotalCols() const;
 	size_t GetTotalBlocks() const { return m_Blocks.size(); }
+	int GetBlockRows(int iBlock) const { return m_Blocks[iBlock].height; }
+	void GetBlockRegion(int iBlock, int &iLeft, int &iTop, int &iWidth, int &iHeight) const;
 	int GetMaxBlockWidth() const;
 	int GetMaxBlockHeight() const;
 
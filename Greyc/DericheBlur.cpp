@@ -3,185 +3,12 @@
 #include "CImgI.h"
 #include <math.h>
 
-void deriche_SSE_row_X_fwd(float *ptrX, float *ptrY, int iWidth, float a0, float a1, float b1, float b2, float coefp, int iStrideBytes)
-{
-	/* can avoid loads; benchmark to see if it's worth it
-	 * also, emms */
-/*	__asm
-	{
-		movd mm0, a0
-		movd mm1, a1
-		movd mm2, b1
-		movd mm3, b2
-	}
-*/	__asm
-	{
-		push eax
-		push ebx
-		push ecx
-		push edx
-		push esi
-
-		mov eax, ptrX
-		mov edx, ptrY
-		mov esi, iWidth
-
-		mov ebx, coefp
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-
-		// xmm4: xp = *ptrX
-		movaps xmm4, [eax]
-		// xmm2: yb = xp*coefp
-		movaps xmm2, xmm4
-		mulps xmm2, xmm0
-
-		// xmm3: yp = xp*coefp
-		movaps xmm3, xmm2
-
-		// const float yc = a0*xc + a1*xp + b1*yp + b2*yb
-do_loop:
-		// xmm1: xc
-		movaps xmm1, [eax]
-		add eax, [iStrideBytes]
-		
-		// xmm5 = a0*xc
-		movaps xmm5, xmm1
-		mov ebx, a0
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-		mulps xmm5, xmm0
-
-		// xmm5 += a1*xp
-		movaps xmm7, xmm4
-		mov ebx, a1
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-		mulps xmm7, xmm0
-		addps xmm5, xmm7
-
-		// xmm5 -= b1*yp
-		movaps xmm7, xmm3
-		mov ebx, b1
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-		mulps xmm7, xmm0
-		subps xmm5, xmm7
-
-		// xmm5 -= b2*yb
-		movaps xmm7, xmm2
-		mov ebx, b2
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-		mulps xmm7, xmm0
-		subps xmm5, xmm7
-		// xmm5 = yc
-
-		// *ptrY = yc
-		movaps [edx], xmm5
-		add edx, 16			// stride in Y is always 4 floats
-
-		movaps xmm4, xmm1 // xp = xc
-		movaps xmm2, xmm3 // yb = yp
-		movaps xmm3, xmm5 // yp = yc
-
-		dec esi
-		jnz do_loop
-
-		pop esi
-		pop edx
-		pop ecx
-		pop ebx
-		pop eax
-	}
-}
-
-void deriche_SSE_row_X_rev(float *ptrX, float *ptrY, int iWidth, float a2, float a3, float b1, float b2, float coefn, int iStrideBytes)
-{
-	__asm
-	{
-		mov eax, ptrX
-		mov edx, ptrY
-		mov esi, iWidth
-
-		mov ebx, coefn
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-
-		// xmm1: xn = *ptrX
-		movaps xmm4, [eax]
-		// xmm4: xa = xn
-		movaps xmm1, xmm4
-		// xmm3: yn = xn*coefn
-		movaps xmm3, xmm4
-		mulps xmm3, xmm0
-		// xmm2: ya = yn
-		movaps xmm2, xmm3
-
-		// const float yc = a2*xn + a3*xa - b1*yn - b2*ya
-do_loop:
-		// xmm6: xc
-		movaps xmm6, [eax]
-		
-		// xmm5 = a2*xn
-		movaps xmm5, xmm4
-		mov ebx, a2
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-		mulps xmm5, xmm0
-
-		// xmm5 += a3*xa
-		movaps xmm7, xmm1
-		mov ebx, a3
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-		mulps xmm7, xmm0
-		addps xmm5, xmm7
-
-		// xmm5 -= b1*yn
-		movaps xmm7, xmm3
-		mov ebx, b1
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-		mulps xmm7, xmm0
-		subps xmm5, xmm7
-
-		// xmm5 -= b2*ya
-		movaps xmm7, xmm2
-		mov ebx, b2
-		movd xmm0, ebx
-		punpckldq xmm0, xmm0
-		punpckldq xmm0, xmm0
-		mulps xmm7, xmm0
-		subps xmm5, xmm7
-		// xmm5 = yc
-
-		// *ptrX = *ptrY+yc;
-		movaps xmm1, [edx]	// *ptrY
-		addps xmm1, xmm5	// += yc
-		movaps [eax], xmm1
-
-		sub eax, [iStrideBytes]
-		sub edx, 16
-
-		movaps xmm1, xmm4 // xa = xn
-		movaps xmm4, xmm6 // xn = xc
-		movaps xmm2, xmm3 // ya = yn
-		movaps xmm3, xmm5 // yn = yc
-
-		dec esi
-		jnz do_loop
-	}
-}
+/* Every path must round the same way, so don't let GCC fuse the multiplies and adds into FMAs
+ * in the AVX2 kernels, or anywhere when building with -mfma.  MSVC and clang don't fuse across
+ * statements. */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
 
 void deriche_C_row_X_fwd(float *ptrX_, float *ptrY_, int iWidth, float a0, float a1, float b1, float b2, float coefp, int iStride, int iChannels)
 {
@@ -227,61 +54,266 @@ void deriche_C_row_X_rev(float *ptrX_, float *ptrY_, int iWidth, float a2, float
 	}
 }
 
-void deriche(CImgF &img, const float sigma, const char axe)
+/*
+ * The SIMD kernels run the recursion of deriche_C_row_X_fwd and _rev on LANES independent signals
+ * at once, one per lane: each sample is LANES consecutive floats, and samples are iStride floats
+ * apart.  Y holds LANES floats per sample.  They use the same operations in the same order as
+ * the C versions, without FMA, so every path gives the same result.  They're written once, in
+ * DericheKernels.h, and compiled once for each instruction set.
+ */
+/* The floats per column panel: one cache line, and a whole number of registers at every SIMD
+ * width.  Vertically on a 3000x2000 image, 16 was the fastest, or within noise of it, at every
+ * width and channel count; SSE2 was up to 1.6x slower with panels of 4, 8, 32 or 64. */
+enum { DERICHE_PANEL = 16 };
+
+struct DericheCoefs
+{
+	float a0, a1, a2, a3, b1, b2, coefp, coefn;
+	int iFeatures;	/* GetSIMDFeatures */
+	bool bPacked;	/* run four rows of a single-channel image together */
+};
+
+struct DericheSSE2
+{
+	enum { LANES = 4 };
+	typedef __m128 F;
+	static F set1(float f) { return _mm_set1_ps(f); }
+	static F load(const float *p) { return _mm_loadu_ps(p); }
+	static void store(float *p, const F &a) { _mm_storeu_ps(p, a); }
+	static F add(const F &a, const F &b) { return _mm_add_ps(a, b); }
+	static F sub(const F &a, const F &b) { return _mm_sub_ps(a, b); }
+	static F mul(const F &a, const F &b) { return _mm_mul_ps(a, b); }
+	static void end() { }
+};
+
+namespace DericheKernelsSSE2
+{
+#include "DericheKernels.h"
+}
+
+SIMD_BEGIN_TARGET_AVX2
+struct DericheAVX2
+{
+	enum { LANES = 8 };
+	typedef __m256 F;
+	static F set1(float f) { return _mm256_set1_ps(f); }
+	static F load(const float *p) { return _mm256_loadu_ps(p); }
+	static void store(float *p, const F &a) { _mm256_storeu_ps(p, a); }
+	static F add(const F &a, const F &b) { return _mm256_add_ps(a, b); }
+	static F sub(const F &a, const F &b) { return _mm256_sub_ps(a, b); }
+	static F mul(const F &a, const F &b) { return _mm256_mul_ps(a, b); }
+
+	/* Clear the upper halves of the registers before returning to SSE code. */
+	static void end() { _mm256_zeroupper(); }
+};
+
+namespace DericheKernelsAVX2
+{
+#include "DericheKernels.h"
+}
+SIMD_END_TARGET
+
+SIMD_BEGIN_TARGET_AVX512
+struct DericheAVX512
+{
+	enum { LANES = 16 };
+	typedef __m512 F;
+	static F set1(float f) { return _mm512_set1_ps(f); }
+	static F load(const float *p) { return _mm512_loadu_ps(p); }
+	static void store(float *p, const F &a) { _mm512_storeu_ps(p, a); }
+	static F add(const F &a, const F &b) { return _mm512_add_ps(a, b); }
+	static F sub(const F &a, const F &b) { return _mm512_sub_ps(a, b); }
+	static F mul(const F &a, const F &b) { return _mm512_mul_ps(a, b); }
+	static void end() { _mm256_zeroupper(); }
+};
+
+namespace DericheKernelsAVX512
+{
+#include "DericheKernels.h"
+}
+SIMD_END_TARGET
+
+static void deriche_C(float *pX, float *pY, int iCount, int iStride, int iChannels, const DericheCoefs &c)
+{
+	deriche_C_row_X_fwd(pX, pY, iCount, c.a0, c.a1, c.b1, c.b2, c.coefp, iStride, iChannels);
+	deriche_C_row_X_rev(pX + (iCount-1)*iStride, pY + (iCount-1)*iChannels, iCount, c.a2, c.a3, c.b1, c.b2, c.coefn, iStride, iChannels);
+}
+
+/*
+ * A single-channel image has no channels to run in parallel, so the packed path runs four
+ * neighboring rows in the SSE lanes instead: they're interleaved into a four-channel row,
+ * filtered, and split again.
+ */
+static void interleave_rows(const CImgF &img, int y, CImgF &Packed)
+{
+	const float *p0 = img.ptr(0,y+0), *p1 = img.ptr(0,y+1), *p2 = img.ptr(0,y+2), *p3 = img.ptr(0,y+3);
+	float *pOut = Packed.ptr(0,0);
+	int x = 0;
+	for(; x + 4 <= img.width; x += 4)
+	{
+		__m128 r0 = _mm_load_ps(p0+x), r1 = _mm_load_ps(p1+x), r2 = _mm_load_ps(p2+x), r3 = _mm_load_ps(p3+x);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		_mm_store_ps(pOut + x*4 + 0, r0);
+		_mm_store_ps(pOut + x*4 + 4, r1);
+		_mm_store_ps(pOut + x*4 + 8, r2);
+		_mm_store_ps(pOut + x*4 + 12, r3);
+	}
+	for(; x < img.width; ++x)
+	{
+		pOut[x*4+0] = p0[x];
+		pOut[x*4+1] = p1[x];
+		pOut[x*4+2] = p2[x];
+		pOut[x*4+3] = p3[x];
+	}
+}
+
+static void deinterleave_rows(const CImgF &Packed, CImgF &img, int y)
+{
+	float *p0 = img.ptr(0,y+0), *p1 = img.ptr(0,y+1), *p2 = img.ptr(0,y+2), *p3 = img.ptr(0,y+3);
+	const float *pIn = Packed.ptr(0,0);
+	int x = 0;
+	for(; x + 4 <= img.width; x += 4)
+	{
+		__m128 r0 = _mm_load_ps(pIn + x*4 + 0), r1 = _mm_load_ps(pIn + x*4 + 4);
+		__m128 r2 = _mm_load_ps(pIn + x*4 + 8), r3 = _mm_load_ps(pIn + x*4 + 12);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		_mm_store_ps(p0+x, r0);
+		_mm_store_ps(p1+x, r1);
+		_mm_store_ps(p2+x, r2);
+		_mm_store_ps(p3+x, r3);
+	}
+	for(; x < img.width; ++x)
+	{
+		p0[x] = pIn[x*4+0];
+		p1[x] = pIn[x*4+1];
+		p2[x] = pIn[x*4+2];
+		p3[x] = pIn[x*4+3];
+	}
+}
+
+static void deriche_init(DericheCoefs &c, const CImgF &img, const float sigma)
 {
-	if (img.is_empty() || sigma<0.1) return;
 	const float nsigma = sigma<0.1f?0.1f:sigma;
         const float alpha = 1.695f/nsigma;
         const float ema = expf(-alpha);
         const float ema2 = expf(-2*alpha);
-        const float b1 = -2*ema;
-        const float b2 = ema2;
+        c.b1 = -2*ema;
+        c.b2 = ema2;
         const float k = (1-ema)*(1-ema)/(1+2*alpha*ema-ema2);
-        const float a0 = k;
-        const float a1 = k*(alpha-1)*ema;
-        const float a2 = k*(alpha+1)*ema;
-        const float a3 = -k*ema2;
-	const float coefp = (a0+a1)/(1+b1+b2);
-	const float coefn = (a2+a3)/(1+b1+b2);
-
-	bool bSSE = !!(GetCPUID() & CPUID_SSE);
-	if(img.dim != 4)
-		bSSE = false;
-	if(img.stride & 0x3) // not aligned
-		bSSE = false;
-
-	CImgF Y;
-	Y.alloc(max(img.height, img.width), 1, img.dim);
-	switch(axe)
+        c.a0 = k;
+        c.a1 = k*(alpha-1)*ema;
+        c.a2 = k*(alpha+1)*ema;
+        c.a3 = -k*ema2;
+	c.coefp = (c.a0+c.a1)/(1+c.b1+c.b2);
+	c.coefn = (c.a2+c.a3)/(1+c.b1+c.b2);
+
+	c.iFeatures = GetSIMDFeatures();
+
+	/* Interleaving reads four rows with aligned loads. */
+	c.bPacked = (c.iFeatures & SIMD_SSE2) && img.dim == 1 && !(img.stride & 0x3);
+}
+
+/* A thread's buffers for one blur, allocated once and reused for each slice. */
+struct DericheBuffers
+{
+	CImgF Y;	/* the forward pass: a row of img.dim channels, or a column panel */
+	CImgF Packed;	/* four interleaved rows, if c.bPacked */
+};
+
+static void deriche_alloc_buffers(const CImgF &img, const DericheCoefs &c, DericheBuffers &buf)
+{
+	buf.Y.alloc(max(img.height, img.width), 1, max(img.dim, (int) DERICHE_PANEL));
+	if(c.bPacked)
+		buf.Packed.alloc(img.width, 1, 4);
+}
+
+/* Filter rows [iStart,iEnd).  If c.bPacked, iStart must be a multiple of 4. */
+static void deriche_rows(CImgF &img, int iStart, int iEnd, const DericheCoefs &c, DericheBuffers &buf)
+{
+	float *pY = buf.Y.data;
+	int y = iStart;
+	if(c.bPacked)
 	{
-	case 'x':
-		cimgI_forY(img,y)
+		for(; y + 4 <= iEnd; y += 4)
 		{
-			if(bSSE)
-				deriche_SSE_row_X_fwd(img.ptr(0,y,0), Y.ptr(0,0,0), img.width, a0, a1, b1, b2, coefp, img.dim * sizeof(float));
-			else
-				deriche_C_row_X_fwd(img.ptr(0,y,0), Y.ptr(0,0,0), img.width, a0, a1, b1, b2, coefp, img.dim, img.dim);
-
-			if(bSSE)
-				deriche_SSE_row_X_rev(img.ptr(img.width-1,y,0), Y.ptr(img.width-1,0,0), img.width, a2, a3, b1, b2, coefn, img.dim * sizeof(float));
-			else
-				deriche_C_row_X_rev(img.ptr(img.width-1,y,0), Y.ptr(img.width-1,0,0), img.width, a2, a3, b1, b2, coefn, img.dim, img.dim);
+			interleave_rows(img, y, buf.Packed);
+			DericheKernelsSSE2::deriche_SIMD<DericheSSE2,1>(buf.Packed.ptr(0,0,0), pY, img.width, 4, c);
+			deinterleave_rows(buf.Packed, img, y);
 		}
-		break;
-	case 'y':
-		cimgI_forX(img,x)
-		{
-			if(bSSE)
-				deriche_SSE_row_X_fwd(img.ptr(x,0,0), Y.ptr(0,0,0), img.height, a0, a1, b1, b2, coefp, img.stride * sizeof(float));
-			else
-				deriche_C_row_X_fwd(img.ptr(x,0,0), Y.ptr(0,0,0), img.height, a0, a1, b1, b2, coefp, img.stride, img.dim);
-
-			if(bSSE)
-				deriche_SSE_row_X_rev(img.ptr(x,img.height-1,0), Y.ptr(img.height-1,0,0), img.height, a2, a3, b1, b2, coefn, img.stride * sizeof(float));
-			else
-				deriche_C_row_X_rev(img.ptr(x,img.height-1,0), Y.ptr(img.height-1,0,0), img.height, a2, a3, b1, b2, coefn, img.stride, img.dim);
-		}
-		break;
+	}
+
+	const bool bSSE = img.dim == 4 && (c.iFeatures & SIMD_SSE2);
+	for(; y < iEnd; ++y)
+	{
+		if(bSSE)
+			DericheKernelsSSE2::deriche_SIMD<DericheSSE2,1>(img.ptr(0,y,0), pY, img.width, 4, c);
+		else
+			deriche_C(img.ptr(0,y,0), pY, img.width, img.dim, img.dim, c);
+	}
+}
+
+/*
+ * Filter columns [iStart,iEnd).  Every float of a row is an independent signal down the
+ * columns, whatever the channel count, and neighboring ones are contiguous.  Run them in panels
+ * of DERICHE_PANEL floats, with as many registers as that takes: one with AVX-512, two with AVX2
+ * or four with SSE2.  What's left over runs in single registers, then in C.
+ */
+static void deriche_columns(CImgF &img, int iStart, int iEnd, const DericheCoefs &c, float *pY)
+{
+	int f = iStart * img.dim;
+	const int iEndF = iEnd * img.dim;
+	if(c.iFeatures & SIMD_AVX512)
+		DericheKernelsAVX512::deriche_SIMD_columns<DericheAVX512>(img, f, iEndF, pY, c);
+	if(c.iFeatures & SIMD_AVX2)
+		DericheKernelsAVX2::deriche_SIMD_columns<DericheAVX2>(img, f, iEndF, pY, c);
+	if(c.iFeatures & SIMD_SSE2)
+		DericheKernelsSSE2::deriche_SIMD_columns<DericheSSE2>(img, f, iEndF, pY, c);
+	for(; f < iEndF; ++f)
+		deriche_C(img.data + f, pY, img.height, img.stride, 1, c);
+}
+
+/* Filter rows ('x') or columns ('y') [iStart,iEnd). */
+static void deriche_range(CImgF &img, const char axe, int iStart, int iEnd, const DericheCoefs &c, DericheBuffers &buf)
+{
+	if(axe == 'x')
+		deriche_rows(img, iStart, iEnd, c, buf);
+	else
+		deriche_columns(img, iStart, iEnd, c, buf.Y.data);
+}
+
+void deriche(CImgF &img, const float sigma, const char axe)
+{
+	if (img.is_empty() || sigma<0.1) return;
+
+	DericheCoefs c;
+	deriche_init(c, img, sigma);
+	DericheBuffers buf;
+	deriche_alloc_buffers(img, c, buf);
+	deriche_range(img, axe, 0, axe == 'x'? img.height:img.width, c, buf);
+}
+
+int get_deriche_slice_count(const CImgF &img, const char axe)
+{
+	const int iCount = axe == 'x'? img.height:img.width;
+	return (iCount + DERICHE_SLICE - 1) / DERICHE_SLICE;
+}
+
+void deriche(CImgF &img, const float sigma, const char axe, Slices *pSlices, volatile bool *pStopRequest)
+{
+	if (img.is_empty() || sigma<0.1) return;
+
+	DericheCoefs c;
+	deriche_init(c, img, sigma);
+	DericheBuffers buf;
+	deriche_alloc_buffers(img, c, buf);
+
+	const int iCount = axe == 'x'? img.height:img.width;
+	int iSlice;
+	while(pSlices->Get(iSlice))
+	{
+		check_cancel;
+		const int iStart = iSlice * DERICHE_SLICE;
+		deriche_range(img, axe, iStart, min(iStart + DERICHE_SLICE, iCount), c, buf);
 	}
 }
 
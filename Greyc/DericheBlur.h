@@ -2,7 +2,16 @@
 #define DERICHE_BLUR_H
 
 #include "CImgI.h"
+#include "Helpers.h"
 
 void deriche(CImgF &img, const float sigma);
+void deriche(CImgF &img, const float sigma, const char axe);
+
+/* Blur along one axis on several threads: each slice is DERICHE_SLICE rows for 'x', or columns
+ * for 'y', which is a whole number of column panels.  pSlices must be initialized to
+ * get_deriche_slice_count. */
+enum { DERICHE_SLICE = 16 };
+int get_deriche_slice_count(const CImgF &img, const char axe);
+void deriche(CImgF &img, const float sigma, const char axe, Slices *pSlices, volatile bool *pStopRequest);
 
 #endif
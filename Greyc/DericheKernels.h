@@ -0,0 +1,91 @@
+/*
+ * The Deriche SIMD kernels; see DericheBlur.cpp.  S is the instruction set's wrapper, like
+ * DericheSSE2.
+ *
+ * There's no include guard: DericheBlur.cpp includes this once per instruction set, in its own
+ * namespace, and for AVX2 and AVX-512 between SIMD_BEGIN_TARGET_* and SIMD_END_TARGET, so each
+ * copy is compiled for its instruction set.
+ */
+
+/*
+ * Run P registers of adjacent signals together: a panel of P*LANES floats.  Each row step reads
+ * the whole panel, so a cache line loaded for one register serves the rest, and the P recursions
+ * are independent, so they overlap in the pipeline.  The coefficients are loaded once, outside
+ * the loop.  Y holds P*LANES floats per sample.
+ */
+template<typename S, int P>
+static void deriche_SIMD_fwd(const float *pX, float *pY, int iCount, int iStride, const DericheCoefs &c)
+{
+	const typename S::F a0 = S::set1(c.a0), a1 = S::set1(c.a1), b1 = S::set1(c.b1), b2 = S::set1(c.b2);
+	const typename S::F coefp = S::set1(c.coefp);
+	typename S::F xp[P], yb[P], yp[P];
+	for(int j = 0; j < P; ++j)
+	{
+		xp[j] = S::load(pX + j*S::LANES);
+		yb[j] = S::mul(coefp, xp[j]);
+		yp[j] = yb[j];
+	}
+	for(int i = 0; i < iCount; ++i)
+	{
+		for(int j = 0; j < P; ++j)
+		{
+			const typename S::F xc = S::load(pX + j*S::LANES);
+			const typename S::F yc = S::sub(S::sub(S::add(S::mul(a0, xc), S::mul(a1, xp[j])), S::mul(b1, yp[j])), S::mul(b2, yb[j]));
+			S::store(pY + j*S::LANES, yc);
+			xp[j] = xc; yb[j] = yp[j]; yp[j] = yc;
+		}
+		pX += iStride;
+		pY += P*S::LANES;
+	}
+	S::end();
+}
+
+/* pX and pY point at the first sample, like deriche_SIMD_fwd; this runs from the last. */
+template<typename S, int P>
+static void deriche_SIMD_rev(float *pX, const float *pY, int iCount, int iStride, const DericheCoefs &c)
+{
+	const typename S::F a2 = S::set1(c.a2), a3 = S::set1(c.a3), b1 = S::set1(c.b1), b2 = S::set1(c.b2);
+	const typename S::F coefn = S::set1(c.coefn);
+	pX += (iCount-1) * iStride;
+	pY += (iCount-1) * P*S::LANES;
+	typename S::F xn[P], xa[P], yn[P], ya[P];
+	for(int j = 0; j < P; ++j)
+	{
+		xn[j] = S::load(pX + j*S::LANES);
+		xa[j] = xn[j];
+		yn[j] = S::mul(coefn, xn[j]);
+		ya[j] = yn[j];
+	}
+	for(int i = 0; i < iCount; ++i)
+	{
+		for(int j = 0; j < P; ++j)
+		{
+			const typename S::F xc = S::load(pX + j*S::LANES);
+			const typename S::F yc = S::sub(S::sub(S::add(S::mul(a2, xn[j]), S::mul(a3, xa[j])), S::mul(b1, yn[j])), S::mul(b2, ya[j]));
+			xa[j] = xn[j]; xn[j] = xc; ya[j] = yn[j]; yn[j] = yc;
+			S::store(pX + j*S::LANES, S::add(S::load(pY + j*S::LANES), yc));
+		}
+		pX -= iStride;
+		pY -= P*S::LANES;
+	}
+	S::end();
+}
+
+template<typename S, int P>
+static void deriche_SIMD(float *pX, float *pY, int iCount, int iStride, const DericheCoefs &c)
+{
+	deriche_SIMD_fwd<S,P>(pX, pY, iCount, iStride, c);
+	deriche_SIMD_rev<S,P>(pX, pY, iCount, iStride, c);
+}
+
+/* Run the columns of floats [f,iEndF) of img in panels of DERICHE_PANEL floats, then single
+ * registers, and advance f past them. */
+template<typename S>
+static void deriche_SIMD_columns(CImgF &img, int &f, int iEndF, float *pY, const DericheCoefs &c)
+{
+	enum { P = DERICHE_PANEL / S::LANES };
+	for(; f + DERICHE_PANEL <= iEndF; f += DERICHE_PANEL)
+		deriche_SIMD<S,P>(img.data + f, pY, img.height, img.stride, c);
+	for(; f + S::LANES <= iEndF; f += S::LANES)
+		deriche_SIMD<S,1>(img.data + f, pY, img.height, img.stride, c);
+}
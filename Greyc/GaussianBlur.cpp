@@ -28,80 +28,67 @@ static void box_blur_C_row(const float *pBoxStart, const float *pBoxEnd, float *
 	}
 }
 
+/* box_blur_C_row for the four channels of a pixel at once.  The weights are loaded once, outside
+ * the loop.  Rows must be aligned. */
 static void box_blur_SSE_row(const float *pBoxStart, const float *pBoxEnd, float *pOut, int x, int N, float *pSum,
 			    float fSumWeight, float fLeftEdgeWeight, float fRightEdgeWeight, int pixel_stride)
 {
-	int iRowCount = N - x;
-	pixel_stride *= sizeof(float);
+	const __m128 SumWeight = _mm_set1_ps(fSumWeight);
+	const __m128 LeftEdgeWeight = _mm_set1_ps(fLeftEdgeWeight);
+	const __m128 RightEdgeWeight = _mm_set1_ps(fRightEdgeWeight);
+	__m128 Sum = _mm_loadu_ps(pSum);
+	for(; x < N; ++x)
+	{
+		const __m128 wL = _mm_load_ps(pBoxStart);
+		const __m128 wR = _mm_load_ps(pBoxEnd);
+		Sum = _mm_sub_ps(Sum, wL);
+		const __m128 Out = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Sum, SumWeight), _mm_mul_ps(wL, LeftEdgeWeight)), _mm_mul_ps(wR, RightEdgeWeight));
+		_mm_store_ps(pOut, Out);
+		Sum = _mm_add_ps(Sum, wR);
 
-	__asm
+		pBoxStart += pixel_stride;
+		pBoxEnd += pixel_stride;
+		pOut += pixel_stride;
+	}
+	_mm_storeu_ps(pSum, Sum);
+}
+
+/* One row of the vertical pass: each of the floats [i, N) in the row has its own running sum
+ * in pSum.  This is box_blur_C_row turned sideways. */
+static void box_blur_C_band(const float *pBoxStart, const float *pBoxEnd, float *pOut, int i, int N, float *pSum,
+			    float fSumWeight, float fLeftEdgeWeight, float fRightEdgeWeight)
+{
+	for(; i < N; ++i)
 	{
-		push esi
-		push edi
-		push eax
-		push ebx
-		push ecx
-		push edx
-
-		mov esi, iRowCount
-
-		mov eax, pSum
-		movups xmm5, [eax]	// xmm5: fSum
-
-		mov eax, pBoxStart
-		mov ebx, pBoxEnd
-		mov edx, pOut
-		mov edi, pixel_stride
-
-main_loop:
-		movaps xmm0, [eax]	// xmm0: wL = *pBoxStart
-		movaps xmm1, [ebx]	// xmm1: wR = *pBoxEnd
-
-		subps xmm5, xmm0	// *fSum -= wL
-
-		mov ecx, fSumWeight
-		movd xmm7, ecx
-		punpckldq xmm7, xmm7
-		punpckldq xmm7, xmm7
-		movups xmm3, xmm5	// fSum
-		mulps xmm3, xmm7	// fSum * fSumWeight
-
-		mov ecx, fLeftEdgeWeight
-		movd xmm7, ecx
-		punpckldq xmm7, xmm7
-		punpckldq xmm7, xmm7
-		movups xmm6, xmm0	// wL
-		mulps xmm6, xmm7	// wL * fLeftEdgeWeight
-		addps xmm3, xmm6
-
-		mov ecx, fRightEdgeWeight
-		movd xmm7, ecx
-		punpckldq xmm7, xmm7
-		punpckldq xmm7, xmm7
-		movups xmm6, xmm1	// wL
-		mulps xmm6, xmm7	// wL * fLeftEdgeWeight
-		addps xmm3, xmm6
-
-		addps xmm5, xmm1	// *fSum += wR
-
-		movaps [edx], xmm3	// *pOut = result
-
-		add eax, edi		// pBoxStart += pixel_stride
-		add ebx, edi		// pBoxEnd += pixel_stride
-		add edx, edi		// pOut += pixel_stride
-	
-		dec esi
-		jnz main_loop
-
-		pop edx
-		pop ecx
-		pop ebx
-		pop eax
-		pop edi
-		pop esi
+		const float wL = pBoxStart[i];
+		const float wR = pBoxEnd[i];
+		pSum[i] -= wL;
+		pOut[i] = pSum[i]*fSumWeight + wL*fLeftEdgeWeight + wR*fRightEdgeWeight;
+		pSum[i] += wR;
 	}
 }
 
+/* box_blur_C_band four floats at a time.  Rows needn't be aligned.  Returns the number of
+ * floats done; box_blur_C_band finishes the rest. */
+static int box_blur_SSE_band(const float *pBoxStart, const float *pBoxEnd, float *pOut, int N, float *pSum,
+			    float fSumWeight, float fLeftEdgeWeight, float fRightEdgeWeight)
+{
+	const __m128 SumWeight = _mm_set1_ps(fSumWeight);
+	const __m128 LeftEdgeWeight = _mm_set1_ps(fLeftEdgeWeight);
+	const __m128 RightEdgeWeight = _mm_set1_ps(fRightEdgeWeight);
+	int i;
+	for(i = 0; i + 4 <= N; i += 4)
+	{
+		const __m128 wL = _mm_loadu_ps(pBoxStart + i);
+		const __m128 wR = _mm_loadu_ps(pBoxEnd + i);
+		__m128 Sum = _mm_sub_ps(_mm_loadu_ps(pSum + i), wL);
+		const __m128 Out = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Sum, SumWeight), _mm_mul_ps(wL, LeftEdgeWeight)), _mm_mul_ps(wR, RightEdgeWeight));
+		_mm_storeu_ps(pOut + i, Out);
+		Sum = _mm_add_ps(Sum, wR);
+		_mm_storeu_ps(pSum + i, Sum);
+	}
+	return i;
+}
 
 /*
  * fBoxWidth: the side of the box to average.
@@ -110,16 +97,23 @@ main_loop:
  * adds enough color-repeated padding around the edge that the black area will never reach
  * the active image area.
  */
-/* Optimize: avoid the extra copy by having an output buffer and ping-ponging the results. */
-void box_blur(CImgF &img, float fBoxWidth, bool bHoriz)
+struct BoxBlur
+{
+	int iBoxOffset;
+	int iBoxWidth;
+	int iSumWidth;
+	float fSumWeight;
+	float fLeftEdgeWeight;
+	float fRightEdgeWeight;
+	bool bSSE;
+	bool bSSEBand;
+};
+
+static void box_blur_init(BoxBlur &b, const CImgF &img, float fBoxWidth)
 {
 	/* Convert fBoxWidth from the size of the box to the distance to average in each direction. */
 	fBoxWidth /= 2.0f;
 
-	CImgF out;
-	out.alloc(img.width, img.height, img.dim, img.stride);
-	out.fill(0);
-
 	/*
 	 * [1] fBoxWidth 0.75, offset = 0.5,
 	 * aaaabbbbccccddddeeee
@@ -138,15 +132,15 @@ void box_blur(CImgF &img, float fBoxWidth, bool bHoriz)
 	const float fEnd = fStart + fBoxWidth*2;
 
 	/* The distance between the weighted value on the right side of the box and the pixel receiving it. */
-	const int iBoxOffset = (int) floorf(fBoxWidth + 0.5f + 1e-05f); /* 1.75 -> 2, distance from e to c */
+	b.iBoxOffset = (int) floorf(fBoxWidth + 0.5f + 1e-05f); /* 1.75 -> 2, distance from e to c */
 
 	/* The distance from the right weighted value to the left weighted value.  (This may be the same as iBoxOffset,
 	 * eg. [2].)  iBoxWidth >= iBoxOffset. */
-	int iBoxWidth = int(floorf(fEnd) - floorf(fStart) + 1e-05f);
+	b.iBoxWidth = int(floorf(fEnd) - floorf(fStart) + 1e-05f);
 	float fRightEdgeWidth;
 	float fLeftEdgeWidth;
 
-	if(iBoxWidth == 0)
+	if(b.iBoxWidth == 0)
 	{
 		fRightEdgeWidth = fEnd - fStart;
 		fLeftEdgeWidth = 0;
@@ -157,126 +151,129 @@ void box_blur(CImgF &img, float fBoxWidth, bool bHoriz)
 		fLeftEdgeWidth = ceilf(fStart + 1e-05f) - fStart;
 	}
 
-	bool bSSE = !!(GetCPUID() & CPUID_SSE);
+	b.bSSE = !!(GetSIMDFeatures() & SIMD_SSE2);
+	b.bSSEBand = b.bSSE;
 	if(img.dim != 4)
-		bSSE = false;
+		b.bSSE = false;
 	if(img.stride & 0x3) // not aligned
-		bSSE = false;
+		b.bSSE = false;
 
 	/* Each pixel is the sum of fTotal (the non-fractional part in the middle of the region) and
 	 * each fractional border pixel.  These won't sum to 1. */
-	const int iSumWidth = lrintf(fBoxWidth*2 - fLeftEdgeWidth - fRightEdgeWidth);
+	b.iSumWidth = lrintf(fBoxWidth*2 - fLeftEdgeWidth - fRightEdgeWidth);
+
+	b.fSumWeight = b.iSumWidth == 0? 0: (1.0f / (fBoxWidth*2));
+	b.fRightEdgeWeight = fRightEdgeWidth / (fBoxWidth*2);
+	b.fLeftEdgeWeight = fLeftEdgeWidth / (fBoxWidth*2);
+}
+
+/* Blur row y of img horizontally into out.  Pixels the box doesn't reach are cleared. */
+static void box_blur_row(const BoxBlur &b, const CImgF &img, CImgF &out, int y)
+{
+	const int N = (int) img.width, pixel_stride = img.dim;
+	memset(out.ptr(0,y,0), 0, N * img.dim * sizeof(float));
 
-	const float fSumWeight = iSumWidth == 0? 0: (1.0f / (fBoxWidth*2));
-	const float fRightEdgeWeight = fRightEdgeWidth / (fBoxWidth*2);
-	const float fLeftEdgeWeight = fLeftEdgeWidth / (fBoxWidth*2);
+	CImgF box_sum;
+	box_sum.alloc(img.dim, 1, 1);
+	box_sum.fill(0);
 
-	if(bHoriz)
+	/* Walk the box up to the first pixel where the whole box is in-bounds; we'll
+	 * start the output there. */
+	int iStartX = min(N, max(b.iBoxWidth, b.iBoxOffset));
+	cimgI_forV(img,v)
 	{
-		const int N = (int) img.width, pixel_stride = img.dim;
-		for(int y = 0; y < (int) img.height; ++y)
+		float &fSum = box_sum(v,0,0);
+		int x = 0;
+		/* Fill in the box sum up to the first sample. */
+		for(x = -b.iSumWidth-1; x < 0; ++x)
+			fSum += img(0,y,v);
+
+		for(; x<iStartX; ++x)
 		{
-			CImgF box_sum;
-			box_sum.alloc(img.dim, 1, 1);
-			box_sum.fill(0);
-
-			/* Walk the box up to the first pixel where the whole box is in-bounds; we'll
-			 * start the output there. */
-			int iStartX = min(N, max(iBoxWidth, iBoxOffset));
-			cimgI_forV(img,v)
-			{
-				float &fSum = box_sum(v,0,0);
-				int x = 0;
-				/* Fill in the box sum up to the first sample. */
-				for(x = -iSumWidth-1; x < 0; ++x)
-					fSum += img(0,y,v);
-
-				for(; x<iStartX; ++x)
-				{
-					fSum -= img(clamp(x-iBoxWidth, 0, N-1), y,v);
-					fSum += img(clamp(x, 0, N-1), y,v);
-				}
-			}
-
-			/* If iBoxWidth > iBoxOffset, we won't actually blur the first (iBoxWidth-iBoxOffset) pixels;
-			 * this is part of the edge artifacting mentioned above.  Copy these source pixels, so we don't
-			 * leave them uninitialized. */
-			cimgI_forV(img,v)
-			{
-				for(int x = 0; x < iBoxOffset; ++x)
-					out(x,y,v) = img(x,y,v);
-			}
-
-			/* Fast path: pixels with nothing averaged from out of bounds. */
-			if(bSSE)
-			{
-				const float *pBoxStart = img.ptr(iStartX-iBoxWidth,y,0);
-				const float *pBoxEnd = img.ptr(iStartX,y,0);
-				float *pOut = out.ptr(iStartX-iBoxOffset,y,0);
-				box_blur_SSE_row(pBoxStart, pBoxEnd, pOut, iStartX, N, box_sum.ptr(0,0,0), fSumWeight, fLeftEdgeWeight, fRightEdgeWeight, pixel_stride);
-			}
-			else
-			{
-				cimgI_forV(img,v)
-				{
-					const float *pBoxStart = img.ptr(iStartX-iBoxWidth,y,v);
-					const float *pBoxEnd = img.ptr(iStartX,y,v);
-					float *pOut = out.ptr(iStartX-iBoxOffset,y,v);
-					box_blur_C_row(pBoxStart, pBoxEnd, pOut, iStartX, N, box_sum.ptr(v,0,0), fSumWeight, fLeftEdgeWeight, fRightEdgeWeight, pixel_stride);
-				}
-			}
+			fSum -= img(clamp(x-b.iBoxWidth, 0, N-1), y,v);
+			fSum += img(clamp(x, 0, N-1), y,v);
 		}
 	}
+
+	/* If iBoxWidth > iBoxOffset, we won't actually blur the first (iBoxWidth-iBoxOffset) pixels;
+	 * this is part of the edge artifacting mentioned above.  Copy these source pixels, so we don't
+	 * leave them uninitialized. */
+	cimgI_forV(img,v)
+	{
+		for(int x = 0; x < b.iBoxOffset; ++x)
+			out(x,y,v) = img(x,y,v);
+	}
+
+	/* Fast path: pixels with nothing averaged from out of bounds. */
+	if(b.bSSE)
+	{
+		const float *pBoxStart = img.ptr(iStartX-b.iBoxWidth,y,0);
+		const float *pBoxEnd = img.ptr(iStartX,y,0);
+		float *pOut = out.ptr(iStartX-b.iBoxOffset,y,0);
+		box_blur_SSE_row(pBoxStart, pBoxEnd, pOut, iStartX, N, box_sum.ptr(0,0,0), b.fSumWeight, b.fLeftEdgeWeight, b.fRightEdgeWeight, pixel_stride);
+	}
 	else
 	{
-		/* Ugh.  Duplicating this is less ugly than a big #define (which is impossible to
-		 * debug), but this is still a mess. */
-		const int N = (int) img.height, pixel_stride = img.stride;
-		for(int x = 0; x < (int) img.width; ++x)
+		cimgI_forV(img,v)
+		{
+			const float *pBoxStart = img.ptr(iStartX-b.iBoxWidth,y,v);
+			const float *pBoxEnd = img.ptr(iStartX,y,v);
+			float *pOut = out.ptr(iStartX-b.iBoxOffset,y,v);
+			box_blur_C_row(pBoxStart, pBoxEnd, pOut, iStartX, N, box_sum.ptr(v,0,0), b.fSumWeight, b.fLeftEdgeWeight, b.fRightEdgeWeight, pixel_stride);
+		}
+	}
+}
+
+/* Blur the columns [iStartX, iEndX) of img vertically into out.  The band is walked a row at a
+ * time with a running sum for each float in the row, so each cache line read serves the whole
+ * band instead of one pixel.  Pixels the box doesn't reach are cleared. */
+static void box_blur_columns(const BoxBlur &b, const CImgF &img, CImgF &out, int iStartX, int iEndX)
+{
+	const int N = (int) img.height;
+	const int iCount = (iEndX - iStartX) * img.dim;
+
+	CImgF box_sum;
+	box_sum.alloc(iCount, 1, 1);
+	box_sum.fill(0);
+	float *pSum = box_sum.ptr(0,0,0);
+
+	int iStartY = min(N, max(b.iBoxWidth, b.iBoxOffset));
+	for(int y = 0; y < iStartY - b.iBoxOffset; ++y)
+		memset(out.ptr(iStartX,y,0), 0, iCount * sizeof(float));
+	for(int y = max(N - b.iBoxOffset, 0); y < N; ++y)
+		memset(out.ptr(iStartX,y,0), 0, iCount * sizeof(float));
+
+	/* Fill in the box sums up to the first sample. */
+	int y;
+	for(y = -b.iSumWidth-1; y < 0; ++y)
+	{
+		const float *pIn = img.ptr(iStartX,0,0);
+		for(int i = 0; i < iCount; ++i)
+			pSum[i] += pIn[i];
+	}
+
+	for(; y<iStartY; ++y)
+	{
+		const float *pBoxStart = img.ptr(iStartX, clamp(y-b.iBoxWidth, 0, N-1), 0);
+		const float *pBoxEnd = img.ptr(iStartX, clamp(y, 0, N-1), 0);
+		for(int i = 0; i < iCount; ++i)
 		{
-			CImgF box_sum;
-			box_sum.alloc(img.dim, 1, 1);
-			box_sum.fill(0);
-
-			int iStartY = min(N, max(iBoxWidth, iBoxOffset));
-			cimgI_forV(img,v)
-			{
-				float &fSum = box_sum(v,0,0);
-				int y = 0;
-				/* Fill in the box sum up to the first sample. */
-				for(y = -iSumWidth-1; y < 0; ++y)
-					fSum += img(x,0,v);
-
-				for(; y<iStartY; ++y)
-				{
-					fSum -= img(x, clamp(y-iBoxWidth, 0, N-1),v);
-					fSum += img(x, clamp(y, 0, N-1),v);
-				}
-			}
-
-			/* Fast path: pixels with nothing averaged from out of bounds. */
-			if(bSSE)
-			{
-				const float *pBoxStart = img.ptr(x, iStartY-iBoxWidth,0);
-				const float *pBoxEnd = img.ptr(x,iStartY,0);
-				float *pOut = out.ptr(x, iStartY-iBoxOffset,0);
-				box_blur_SSE_row(pBoxStart, pBoxEnd, pOut, iStartY, N, box_sum.ptr(0,0,0), fSumWeight, fLeftEdgeWeight, fRightEdgeWeight, pixel_stride);
-			}
-			else
-			{
-				cimgI_forV(img,v)
-				{
-					float &fSum = box_sum(v,0,0);
-					const float *pBoxStart = img.ptr(x, iStartY-iBoxWidth,v);
-					const float *pBoxEnd = img.ptr(x,iStartY,v);
-					float *pOut = out.ptr(x, iStartY-iBoxOffset,v);
-					box_blur_C_row(pBoxStart, pBoxEnd, pOut, iStartY, N, &fSum, fSumWeight, fLeftEdgeWeight, fRightEdgeWeight, pixel_stride);
-				}
-			}
+			pSum[i] -= pBoxStart[i];
+			pSum[i] += pBoxEnd[i];
 		}
 	}
 
-	img.swap(out);
+	/* Fast path: pixels with nothing averaged from out of bounds. */
+	for(; y < N; ++y)
+	{
+		const float *pBoxStart = img.ptr(iStartX, y-b.iBoxWidth, 0);
+		const float *pBoxEnd = img.ptr(iStartX, y, 0);
+		float *pOut = out.ptr(iStartX, y-b.iBoxOffset, 0);
+		int i = 0;
+		if(b.bSSEBand)
+			i = box_blur_SSE_band(pBoxStart, pBoxEnd, pOut, iCount, pSum, b.fSumWeight, b.fLeftEdgeWeight, b.fRightEdgeWeight);
+		box_blur_C_band(pBoxStart, pBoxEnd, pOut, i, iCount, pSum, b.fSumWeight, b.fLeftEdgeWeight, b.fRightEdgeWeight);
+	}
 }
 
 /*
@@ -336,59 +333,95 @@ static float ScaleAlpha(float a)
 	return scale(a, samples[i].fPhotoshop, samples[i-1].fPhotoshop, samples[i].fBox, samples[i-1].fBox);
 }
 
-/* Approximate a Gaussian blur with three box filters. */
-void gaussian_blur_estimation(CImgF &i, float a, volatile bool *pStopRequest)
+/*
+ * Approximate a Gaussian blur with three box filters.
+ *
+ * Handle the border like Photoshop does: add a border around the image, repeat border
+ * pixels into the empty space, and then keep it around for each box filter pass.  This
+ * is different than just emulating GL_CLAMP, since the border area will be blurred after
+ * each pass, too.
+ *
+ * The passes ping-pong between two bordered buffers: pass 0 copies the image into the first,
+ * passes 1-6 are the box filters, and pass 7 copies the result back.
+ */
+void GaussianBlurPasses::Init(const CImgF &img, float a)
 {
-	a = ScaleAlpha(a);
-
-	/* Handle the border like Photoshop does: add a border around the image, repeat border
-	 * pixels into the empty space, and then keep it around for each box filter pass.  This
-	 * is different than just emulating GL_CLAMP, since the border area will be blurred after
-	 * each pass, too. */
-	int iBuffer = int(ceilf(a))*3;
-	CImgF iCopy;
-	iCopy.alloc(i.width + iBuffer*2, i.height + iBuffer*2, i.dim);
-	iCopy.draw_image(i, iBuffer, iBuffer);
-
-	for(int y = 0; y < iBuffer; ++y) cimgI_forXV(iCopy,x,v)
-	{
-		iCopy(x,y,v) = iCopy(
-			clamp(x, iBuffer, int(iCopy.width) - iBuffer - 1),
-			clamp(y, iBuffer, int(iCopy.height) - iBuffer - 1), v);
-	}
-	for(int y = iBuffer; y < (int) iCopy.height - iBuffer; ++y)
+	m_fBoxWidth = ScaleAlpha(a);
+	m_iBuffer = int(ceilf(m_fBoxWidth))*3;
+	m_Buffers[0].alloc(img.width + m_iBuffer*2, img.height + m_iBuffer*2, img.dim);
+	m_Buffers[1].alloc(m_Buffers[0].width, m_Buffers[0].height, m_Buffers[0].dim, m_Buffers[0].stride);
+}
+
+void GaussianBlurPasses::Free()
+{
+	m_Buffers[0].free();
+	m_Buffers[1].free();
+}
+
+int GaussianBlurPasses::GetSliceCount(int iPass) const
+{
+	/* The vertical passes take bands of columns, so threads don't share cache lines. */
+	if(iPass >= 4 && iPass <= 6)
+		return (m_Buffers[0].width + BOX_BLUR_BAND - 1) / BOX_BLUR_BAND;
+	if(iPass == 7)
+		return m_Buffers[0].height - m_iBuffer*2;
+	return m_Buffers[0].height;
+}
+
+void GaussianBlurPasses::Run(int iPass, CImgF &img, Slices *pSlices, volatile bool *pStopRequest)
+{
+	const int iBuffer = m_iBuffer;
+	int iSlice;
+	if(iPass == 0)
 	{
-		for(int x = 0; x < iBuffer; ++x)
+		CImgF &Copy = m_Buffers[0];
+		while(pSlices->Get(iSlice))
 		{
-			cimgI_forV(iCopy,v)
-			{
-				iCopy(x,y,v) = iCopy(
-					clamp(x, iBuffer, int(iCopy.width) - iBuffer - 1),
-					clamp(y, iBuffer, int(iCopy.height) - iBuffer - 1), v);
-			}
-		}
-		for(int x = iCopy.width - iBuffer; x < (int) iCopy.width; ++x)
-		{
-			cimgI_forV(iCopy,v)
-			{
-				iCopy(x,y,v) = iCopy(
-					clamp(x, iBuffer, int(iCopy.width) - iBuffer - 1),
-					clamp(y, iBuffer, int(iCopy.height) - iBuffer - 1), v);
-			}
+			const float *pSource = img.ptr(0, clamp(iSlice - iBuffer, 0, img.height - 1), 0);
+			float *pDest = Copy.ptr(0, iSlice, 0);
+			for(int x = 0; x < iBuffer; ++x)
+				memcpy(pDest + x*img.dim, pSource, img.dim * sizeof(float));
+			memcpy(pDest + iBuffer*img.dim, pSource, img.width * img.dim * sizeof(float));
+			for(int x = iBuffer + img.width; x < Copy.width; ++x)
+				memcpy(pDest + x*img.dim, pSource + (img.width-1)*img.dim, img.dim * sizeof(float));
 		}
+		return;
+	}
+
+	if(iPass == 7)
+	{
+		/* Six box passes leave the result back in the first buffer. */
+		const CImgF &Copy = m_Buffers[0];
+		while(pSlices->Get(iSlice))
+			memcpy(img.ptr(0, iSlice, 0), Copy.ptr(iBuffer, iSlice + iBuffer, 0), img.width * img.dim * sizeof(float));
+		return;
 	}
-	for(int y = iCopy.height - iBuffer; y < (int) iCopy.height; ++y) cimgI_forXV(iCopy,x,v)
+
+	const CImgF &In = m_Buffers[(iPass-1) % 2];
+	CImgF &Out = m_Buffers[iPass % 2];
+	BoxBlur b;
+	box_blur_init(b, In, m_fBoxWidth);
+	const bool bHoriz = iPass <= 3;
+	while(pSlices->Get(iSlice))
+	{
+		check_cancel;
+		if(bHoriz)
+			box_blur_row(b, In, Out, iSlice);
+		else
+			box_blur_columns(b, In, Out, iSlice * BOX_BLUR_BAND, min((iSlice + 1) * BOX_BLUR_BAND, In.width));
+	}
+}
+
+void gaussian_blur_estimation(CImgF &i, float a, volatile bool *pStopRequest)
+{
+	GaussianBlurPasses Blur;
+	Blur.Init(i, a);
+
+	Slices slices;
+	for(int iPass = 0; iPass < GaussianBlurPasses::PASSES; ++iPass)
 	{
-		iCopy(x,y,v) = iCopy(
-			clamp(x, iBuffer, int(iCopy.width) - iBuffer - 1),
-			clamp(y, iBuffer, int(iCopy.height) - iBuffer - 1), v);
+		slices.Init(Blur.GetSliceCount(iPass));
+		Blur.Run(iPass, i, &slices, pStopRequest);
+		check_cancel;
 	}
-	box_blur(iCopy, a, true);		check_cancel;
-	box_blur(iCopy, a, true);		check_cancel;
-	box_blur(iCopy, a, true);		check_cancel;
-	box_blur(iCopy, a, false);		check_cancel;
-	box_blur(iCopy, a, false);		check_cancel;
-	box_blur(iCopy, a, false);		check_cancel;
-
-	i.draw_image(iCopy, -iBuffer, -iBuffer);
 }
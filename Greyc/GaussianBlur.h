@@ -2,7 +2,29 @@
 #define GAUSSIAN_BLUR_H
 
 #include "CImgI.h"
+#include "Helpers.h"
 
 void gaussian_blur_estimation(CImgF &i, float a, volatile bool *pStopRequest);
 
+/*
+ * gaussian_blur_estimation in passes, so several threads can share each one.  Call Init, then
+ * for each pass in turn, initialize a Slices to GetSliceCount(iPass) and call Run on each thread.
+ * Every thread must finish a pass before any thread starts the next.
+ */
+class GaussianBlurPasses
+{
+public:
+	enum { PASSES = 8 };
+	void Init(const CImgF &img, float a);
+	void Free();
+	int GetSliceCount(int iPass) const;
+	void Run(int iPass, CImgF &img, Slices *pSlices, volatile bool *pStopRequest);
+
+private:
+	enum { BOX_BLUR_BAND = 16 }; /* columns per slice of the vertical passes */
+	float m_fBoxWidth;
+	int m_iBuffer;
+	CImgF m_Buffers[2];
+};
+
 #endif
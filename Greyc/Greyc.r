@@ -190,6 +190,18 @@ resource 'aete' (16000, "GREYCstoration dictionary", purgeable)
 				"gauss precision",							/* optional description */
 				flagsSingleParameter,						/* parameter flags */
 
+				"flat threshold",							/* parameter name */
+				keyFlatThreshold,							/* parameter key ID */
+				typeFloat,									/* parameter type ID */
+				"flat region threshold",					/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"adaptive angles",							/* parameter name */
+				keyAdaptiveAngles,							/* parameter key ID */
+				typeFloat,									/* parameter type ID */
+				"adaptive angle isotropy",					/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
 				"interpolation",							/* parameter name */
 				keyInterpolation,							/* parameter key ID */
 				typeInterpolation,							/* parameter type ID */
@@ -208,12 +220,72 @@ resource 'aete' (16000, "GREYCstoration dictionary", purgeable)
 				"alternate amplitude calculate",			/* optional description */
 				flagsSingleParameter,						/* parameter flags */
 
+				"fast lic",									/* parameter name */
+				keyFastLIC,									/* parameter key ID */
+				typeBoolean,								/* parameter type ID */
+				"share samples along streamlines",			/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"simt walk",								/* parameter name */
+				keySIMTWalk,								/* parameter key ID */
+				typeBoolean,								/* parameter type ID */
+				"walk 8 or 16 streamlines at once",			/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"bidirectional",							/* parameter name */
+				keyBidirectional,							/* parameter key ID */
+				typeBoolean,								/* parameter type ID */
+				"walk opposite angles together",			/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"luma/chroma",								/* parameter name */
+				keyLumaChroma,								/* parameter key ID */
+				typeBoolean,								/* parameter type ID */
+				"smooth chroma at half resolution",		/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
 				"iterations",								/* parameter name */
 				keyIterations,								/* parameter key ID */
 				typeInteger,								/* parameter type ID */
 				"iterations",								/* optional description */
 				flagsSingleParameter,						/* parameter flags */
 
+				"convergence tolerance",					/* parameter name */
+				keyConvergenceTolerance,					/* parameter key ID */
+				typeFloat,									/* parameter type ID */
+				"convergence tolerance",					/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"fuse iterations",							/* parameter name */
+				keyFuseIterations,							/* parameter key ID */
+				typeBoolean,								/* parameter type ID */
+				"iterate each block in floating point",		/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"w format",									/* parameter name */
+				keyWFormat,									/* parameter key ID */
+				typeWFormat,								/* parameter type ID */
+				"vector field storage",						/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"angle scheduling",							/* parameter name */
+				keyAngleScheduling,							/* parameter key ID */
+				typeAngleScheduling,						/* parameter type ID */
+				"angle scheduling",							/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"tile size",								/* parameter name */
+				keyTileSize,								/* parameter key ID */
+				typeInteger,								/* parameter type ID */
+				"tile size",								/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
+				"tensor scale",								/* parameter name */
+				keyTensorScale,								/* parameter key ID */
+				typeInteger,								/* parameter type ID */
+				"structure tensor scale",					/* optional description */
+				flagsSingleParameter,						/* parameter flags */
+
 				"ignore selection",							/* optional parameter */
 				keyIgnoreSelection,							/* key ID */
 				typeBoolean,								/* type */
@@ -258,6 +330,36 @@ resource 'aete' (16000, "GREYCstoration dictionary", purgeable)
 				interpolationRungeKutta,
 				"runge-kutta"
 			},
+
+			typeWFormat,
+			{
+				"float",
+				wFormatFloat,
+				"float",
+
+				"half",
+				wFormatHalf,
+				"half float",
+
+				"fixed",
+				wFormatFixed,
+				"fixed point"
+			},
+
+			typeAngleScheduling,
+			{
+				"per pass",
+				angleSchedulingPerPass,
+				"one pass per angle",
+
+				"fused tiles",
+				angleSchedulingFusedTiles,
+				"every angle per tile",
+
+				"tasks",
+				angleSchedulingTasks,
+				"angle tasks"
+			},
 			
 			typeDisplayMode,
 			{
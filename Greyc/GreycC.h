@@ -4,25 +4,181 @@
 #include "CImgI.h"
 #include "Helpers.h"
 
-void do_blur_anisotropic_prep(CImgF &img, CImgF &G, volatile bool *pStopRequest, volatile LONG *pProgress,
-                        float fPreBlur, float alpha, float sigma, float geom_factor, int stage);
+/* If iTensorScale is greater than 1, G is returned at 1/iTensorScale resolution, and everything
+ * that reads G or G2 afterwards needs iTensorScale. */
+void do_blur_anisotropic_prep(CImgF &img, CImgF &G, volatile bool *pStopRequest,
+                        float fPreBlur, float alpha, float sigma, float geom_factor, int iTensorScale, int stage);
+int get_auto_tensor_scale(const float sigma);
 
+/*
+ * The stages of do_blur_anisotropic_prep after the pre-blur, for running on several threads.
+ * The range and tensor stages each take bands of rows from a Slices initialized to
+ * get_prep_band_count.  The range stage is only needed for normalizing (geom_factor <= 0): it
+ * extends fMin and fMax to the range of the blurred image, which the caller combines across threads.
+ * The tensor stage writes into G, which alloc_prep_tensors allocates.  The sigma blur is then
+ * deriche(G, get_prep_sigma(sigma, iTensorScale)).
+ */
+int get_prep_band_count(const CImgF &img, float alpha);
+void do_blur_anisotropic_prep_range(const CImgF &img, float alpha, Slices *pSlices, volatile bool *pStopRequest,
+	float &fMin, float &fMax);
+float get_prep_gradient_scale(float geom_factor, float fMin, float fMax);
+void alloc_prep_tensors(const CImgF &img, CImgF &G, int iTensorScale);
+void do_blur_anisotropic_prep_tensors(const CImgF &img, CImgF &G, float alpha, float fGradientScale, int iTensorScale,
+	Slices *pSlices, volatile bool *pStopRequest);
+float get_prep_sigma(float sigma, int iTensorScale);
+
+/* Flat-region mode: see do_blur_anisotropic_classify_row.  Weight is the walk's share of each
+ * pixel, from 0 to 255, and zero where the pixel is masked. */
+struct FlatRegions
+{
+	float fThreshold;	/* the gradient at which pixels are fully walked */
+	CImg Weight;
+	CImgF Blurred[2];	/* the image blurred for s2 = 1 and for s2 = fThresholdS2 */
+	float afSigma[2];	/* the blur of each of Blurred */
+	float fThresholdS2;
+};
+
+/* Adaptive angles: see do_blur_anisotropic_classify_angles_row.  Pixels at level L walk the
+ * angles whose index is a multiple of 2^L. */
+struct AdaptiveAngles
+{
+	enum { MAX_LEVEL = 2 };
+	float fThreshold;	/* the G2 isotropy at which pixels walk every other angle */
+	int iMaxLevel;		/* the coarsest level to use */
+	CImg Mask[MAX_LEVEL];	/* Mask[i] is the walk's mask for levels up to i */
+	int aiAngles[MAX_LEVEL+1];	/* the number of angles each level walks */
+};
+
+/* Set aiAngles and iMaxLevel for iSteps angle steps, each walking two angles if bBidirectional. */
+void set_adaptive_angle_counts(AdaptiveAngles &Angles, int iSteps, bool bBidirectional);
+
+/* Return the mask to walk angle step iStep with.  WalkMask is the mask for the coarsest level. */
+const CImg &get_adaptive_angle_mask(const AdaptiveAngles &Angles, int iStep, const CImg &WalkMask);
+
+/* If pFlat isn't NULL, also fill in pFlat->Weight, which must be allocated.  If pAngles isn't
+ * NULL, also fill in pAngles->Mask, which must be allocated, from pFlat->Weight if pFlat isn't NULL
+ * and mask otherwise. */
 void do_blur_anisotropic(const CImgF &G, CImgF &G2, volatile bool *pStopRequest, volatile LONG *pProgress,
-			Slices *pSlices, float sharpness, float anisotropy);
+			Slices *pSlices, float sharpness, float anisotropy, bool bSIMD,
+			const CImg &mask, FlatRegions *pFlat, AdaptiveAngles *pAngles, int iTensorScale);
+bool do_blur_anisotropic_flat_prep(const CImgF &img, FlatRegions &Flat, const float amplitude, const float gauss_prec,
+			const bool fast_approx, const float sharpness, const float anisotropy);
 
-void do_blur_anisotropic_init_for_angle(const CImgF &G, CImgF &W, volatile bool *pStopRequest, volatile LONG *pProgress,
+void do_blur_anisotropic_init_for_angle(const CImgF &G, int iTensorScale, CImgF &W, volatile bool *pStopRequest, volatile LONG *pProgress,
+			Slices *pSlices, float theta, const float dl);
+void do_blur_anisotropic_init_for_angle(const CImgF &G, int iTensorScale, CImgW &W, volatile bool *pStopRequest, volatile LONG *pProgress,
 			Slices *pSlices, float theta, const float dl);
 
-void do_blur_anisotropic_with_vectors_angle(CImgF &img, CImgF &W, const CImg &mask,  CImgF &dest,
+/* If bSIMT is true, walk several pixels at once with AVX2 or AVX-512 if possible.  This needs
+ * a four-channel image.
+ *
+ * If bBidirectional is true, also walk theta+180 from the same W, by following each streamline
+ * backwards from its pixel.  The caller then skips the angles from 180 on; see
+ * angles_have_opposites. */
+void do_blur_anisotropic_with_vectors_angle(CImgF &img, const CImgF &W, const CImg &mask,  CImgF &dest,
 			volatile bool *pStopRequest, volatile LONG *pProgress,
 			Slices *pSlices,
 			const bool alt_amplitude,
 			const float amplitude,
 			const float dl,
 			const float gauss_prec, const unsigned int interpolation,
-			const bool fast_approx);
+			const bool fast_approx, const bool bSIMT, const bool bBidirectional);
+void do_blur_anisotropic_with_vectors_angle(CImgF &img, const CImgW &W, const CImg &mask,  CImgF &dest,
+			volatile bool *pStopRequest, volatile LONG *pProgress,
+			Slices *pSlices,
+			const bool alt_amplitude,
+			const float amplitude,
+			const float dl,
+			const float gauss_prec, const unsigned int interpolation,
+			const bool fast_approx, const bool bBidirectional);
+
+/* Walk the streamlines for one angle with FastLIC, for fast_approx only.  The result differs
+ * slightly from do_blur_anisotropic_with_vectors_angle; see do_blur_anisotropic_fastlic_tile.
+ * The caller must Init pSlices to get_fused_tile_count(). */
+void do_blur_anisotropic_fastlic_angle(CImgF &img, const CImgF &W, const CImg &mask,  CImgF &dest,
+			volatile bool *pStopRequest, volatile LONG *pProgress,
+			Slices *pSlices, int iTileSize,
+			const bool alt_amplitude,
+			const float amplitude,
+			const float dl,
+			const float gauss_prec, const unsigned int interpolation, const bool bBidirectional);
+void do_blur_anisotropic_fastlic_angle(CImgF &img, const CImgW &W, const CImg &mask,  CImgF &dest,
+			volatile bool *pStopRequest, volatile LONG *pProgress,
+			Slices *pSlices, int iTileSize,
+			const bool alt_amplitude,
+			const float amplitude,
+			const float dl,
+			const float gauss_prec, const unsigned int interpolation, const bool bBidirectional);
+
+bool angles_have_opposites(const float da);
+int get_streamline_reach(const float amplitude, const float dl, const float gauss_prec);
+int get_fused_tile_count(const CImgF &img, int iTileSize);
+void do_blur_anisotropic_fused_tiles(CImgF &img, const CImgF &G, int iTensorScale, const CImg &mask, CImgF &dest,
+			volatile bool *pStopRequest, volatile LONG *pProgress,
+			Slices *pSlices, int iTileSize, bool bCompactW, CImgW::Format CompactFormat,
+			const float da,
+			const bool alt_amplitude,
+			const float amplitude,
+			const float dl,
+			const float gauss_prec, const unsigned int interpolation,
+			const bool fast_approx, const bool bSIMT, const bool bFastLIC, const bool bBidirectional);
+
+/* The accumulator of one group of angles for do_blur_anisotropic_angle_tasks.  Tasks on different
+ * threads set different entries of abBandsTouched, so it isn't a vector<bool>. */
+struct AngleTaskAccumulator
+{
+	CImgF Dest;
+	vector<char> abBandsTouched;
+};
+
+int get_angle_task_count(const CImgF &img, int iBandHeight, int iGroups);
+void do_blur_anisotropic_angle_tasks(CImgF &img, const CImgF &G, int iTensorScale, const CImg &mask, AngleTaskAccumulator *pAccumulators, int iGroups,
+			volatile bool *pStopRequest, volatile LONG *pProgress,
+			Slices *pSlices, int iBandHeight, bool bCompactW, CImgW::Format CompactFormat,
+			const float da,
+			const bool alt_amplitude,
+			const float amplitude,
+			const float dl,
+			const float gauss_prec, const unsigned int interpolation,
+			const bool fast_approx, const bool bSIMT, const bool bBidirectional);
+void do_blur_anisotropic_reduce_angle_tasks(AngleTaskAccumulator * const *ppAcc, int iAccumulators, CImgF &dest,
+			Slices *pSlices, int iBandHeight, volatile bool *pStopRequest);
+
+/* The change made to a block by an iteration, for convergence: the sum of the squared change of
+ * each sample inside the region, and the number of samples. */
+struct BlockChange
+{
+	int l, t, width, height;
+	double fSumSquares;
+	int iSamples;
+};
+
+/* If pChange isn't NULL, also add the change to *pChange.  If pAngles isn't NULL, N is taken from
+ * each pixel's level instead. */
+void do_blur_anisotropic_finalize(const CImgF &dest, CImgF &img, int N, const AdaptiveAngles *pAngles,
+	const CImg &mask, Slices *pSlices, volatile bool *pStopRequest, BlockChange *pChange);
+void do_blur_anisotropic_finalize_flat(const CImgF &dest, CImgF &img, int N, const AdaptiveAngles *pAngles,
+	const CImg &mask, const FlatRegions &Flat, const CImgF &G2, int iTensorScale, Slices *pSlices, volatile bool *pStopRequest,
+	BlockChange *pChange);
+
+/*
+ * Luma/chroma mode; see do_luma_chroma_split.  img has iChannels real channels, RGB first.
+ * Split converts img into Luma, Y and the channels after RGB, at full size, and Chroma, Cb and
+ * Cr, at half size.  ChromaMask is set from mask if it isn't empty.  pSlices is over Chroma's
+ * rows.
+ */
+void do_luma_chroma_split(const CImgF &img, int iChannels, const CImg &mask, CImgF &Luma, CImgF &Chroma, CImg &ChromaMask,
+	Slices *pSlices, volatile bool *pStopRequest);
+
+/* Set Half, at the size of Chroma, to the mean of G2 over each 2x2 block of the iWidth x iHeight
+ * image.  pSlices is over Half's rows. */
+void get_half_tensor(const CImgF &G2, int iTensorScale, int iWidth, int iHeight, CImgF &Half,
+	Slices *pSlices, volatile bool *pStopRequest);
 
-void do_blur_anisotropic_finalize(const CImgF &dest, CImgF &img, int N,
-	const CImg &mask, Slices *pSlices, volatile bool *pStopRequest);
+/* Convert Luma and Chroma, scaled up bilinearly, back into img.  Pixels outside mask are left
+ * alone.  pSlices is over img's rows.  If pChange isn't NULL, also add the change to img's
+ * channels to *pChange, as do_blur_anisotropic_finalize does. */
+void do_luma_chroma_merge(const CImgF &Luma, const CImgF &Chroma, int iChannels, const CImg &mask,
+	CImgF &img, Slices *pSlices, volatile bool *pStopRequest, BlockChange *pChange);
 
 #endif
@@ -1,6 +1,9 @@
 #define _WIN32_WINNT 0x0400
 #include "Helpers.h"
 #include <assert.h>
+#if !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
 
 #pragma comment(lib, "winmm.lib") // for timeGetTime
 
@@ -556,6 +559,74 @@ int GetCPUID()
 }
 #endif
 
+/* cpuid and xgetbv are compiler intrinsics with different spellings; wrap them, so the feature
+ * check below is the same everywhere. */
+static void get_cpuid(int info[4], int iLeaf, int iSubLeaf)
+{
+#if defined(_MSC_VER)
+	__cpuidex(info, iLeaf, iSubLeaf);
+#else
+	unsigned int a = 0, b = 0, c = 0, d = 0;
+	__cpuid_count(iLeaf, iSubLeaf, a, b, c, d);
+	info[0] = (int) a; info[1] = (int) b; info[2] = (int) c; info[3] = (int) d;
+#endif
+}
+
+/* Return XCR0, the register state the OS saves.  Only call this if cpuid reports OSXSAVE. */
+static unsigned long long get_xcr0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(_XCR_XFEATURE_ENABLED_MASK);
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return ((unsigned long long) hi << 32) | lo;
+#endif
+}
+
+int GetSIMDFeatures()
+{
+	static bool bInitialized = false;
+	static int iFeatures = 0;
+	if(bInitialized)
+		return iFeatures;
+
+	int info[4];
+	get_cpuid(info, 0, 0);
+	const int iMaxLeaf = info[0];
+
+	get_cpuid(info, 1, 0);
+	const int iECX1 = info[2], iEDX1 = info[3];
+	if(iEDX1 & (1<<26))
+		iFeatures |= SIMD_SSE2;
+
+	/* AVX requires OSXSAVE, and the OS must have enabled the XMM and YMM state. */
+	const bool bOSXSAVE = !!(iECX1 & (1<<27));
+	const bool bAVX = !!(iECX1 & (1<<28));
+	const bool bFMA = !!(iECX1 & (1<<12));
+	unsigned long long iXCR0 = 0;
+	if(bOSXSAVE)
+		iXCR0 = get_xcr0();
+	const bool bOSYMM = (iXCR0 & 0x06) == 0x06;
+	const bool bOSZMM = (iXCR0 & 0xE6) == 0xE6;
+
+	if(bAVX && bOSYMM && (iECX1 & (1<<29)))
+		iFeatures |= SIMD_F16C;
+
+	if(iMaxLeaf >= 7)
+	{
+		get_cpuid(info, 7, 0);
+		const int iEBX7 = info[1];
+		if(bAVX && bFMA && bOSYMM && (iEBX7 & (1<<5)))
+			iFeatures |= SIMD_AVX2;
+		if(bOSZMM && (iEBX7 & (1<<16)))
+			iFeatures |= SIMD_AVX512;
+	}
+
+	bInitialized = true;
+	return iFeatures;
+}
+
 void ScaleArea(float f, int &iX, int &iY, int &iWidth, int &iHeight)
 {
 	if(f == 0)
@@ -7,12 +7,18 @@
 #include <string>
 #include <memory>
 #include <windows.h>
+#if defined(_MSC_VER)
 #include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
 using namespace std;
 
 extern HINSTANCE g_hInstance;
 
+#if defined(_MSC_VER)
 #pragma intrinsic (_InterlockedIncrement)
+#endif
 #define InterlockedIncrement _InterlockedIncrement
 
 typedef signed char int8_t;
@@ -106,7 +112,7 @@ private:
 	Action m_Action;
 	void RunAction(Action a);
 
-	auto_ptr<Callback> m_pCallback;
+	unique_ptr<Callback> m_pCallback;
 
 	/* State for ACTION_READ: */
 	void *m_pReadRequestBuf;
@@ -165,7 +171,49 @@ void QueueDebugBreak(int iMilliseconds);
 int GetCPUID();
 #endif
 
-#if defined(_WIN64)
+/* Instruction sets we have optimized kernels for.  These are only set if both the CPU
+ * and the OS support them (AVX state must be saved by the OS on context switches). */
+#define SIMD_SSE2	0x01
+#define SIMD_AVX2	0x02	/* AVX2 and FMA3 */
+#define SIMD_F16C	0x04
+#define SIMD_AVX512	0x08	/* AVX-512F */
+int GetSIMDFeatures();
+
+/* MSVC lets any function use any instruction set's intrinsics.  GCC and clang only inline them
+ * into functions compiled for that instruction set, so kernels for one are marked with
+ * SIMD_TARGET_*, and templates instantiated for one are defined between SIMD_BEGIN_TARGET_* and
+ * SIMD_END_TARGET.  Either way, only call them if GetSIMDFeatures() has the matching flag. */
+#if defined(_MSC_VER)
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#define SIMD_TARGET_F16C
+#define SIMD_BEGIN_TARGET_AVX2
+#define SIMD_BEGIN_TARGET_AVX512
+#define SIMD_END_TARGET
+#elif defined(__clang__)
+#define SIMD_TARGET_AVX2	__attribute__((target("avx2,fma")))
+#define SIMD_TARGET_AVX512	__attribute__((target("avx512f")))
+#define SIMD_TARGET_F16C	__attribute__((target("f16c")))
+#define SIMD_BEGIN_TARGET_AVX2	_Pragma("clang attribute push(__attribute__((target(\"avx2,fma\"))), apply_to = function)")
+#define SIMD_BEGIN_TARGET_AVX512	_Pragma("clang attribute push(__attribute__((target(\"avx512f\"))), apply_to = function)")
+#define SIMD_END_TARGET	_Pragma("clang attribute pop")
+#else
+/* GCC 12's AVX-512 intrinsics trip -Wmaybe-uninitialized on their own placeholder operands,
+ * so it's ignored in the target regions. */
+#define SIMD_TARGET_AVX2	__attribute__((target("avx2,fma")))
+#define SIMD_TARGET_AVX512	__attribute__((target("avx512f")))
+#define SIMD_TARGET_F16C	__attribute__((target("f16c")))
+#define SIMD_BEGIN_TARGET_AVX2	_Pragma("GCC push_options") _Pragma("GCC target(\"avx2,fma\")") \
+	_Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+#define SIMD_BEGIN_TARGET_AVX512	_Pragma("GCC push_options") _Pragma("GCC target(\"avx512f\")") \
+	_Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+#define SIMD_END_TARGET	_Pragma("GCC diagnostic pop") _Pragma("GCC pop_options")
+#endif
+
+/* MSVC has no lrintf, and 64-bit MSVC has no inline assembly.  Other compilers have it in math.h. */
+#if !defined(_MSC_VER)
+#include <math.h>
+#elif defined(_WIN64)
 inline long int lrintf(float f)
 {
         return f >= 0.0f ? (int)floorf(f + 0.5f) : (int)ceilf(f - 0.5f);
@@ -198,7 +246,9 @@ static inline float scale(float x, float l1, float h1, float l2, float h2)
 #define check_cancel { if (*pStopRequest) { printf("cancelled\n"); return; } }
 #define progress_and_check_cancel { check_cancel; progress; }
 
+#ifndef M_PI
 #define M_PI 3.1415926535897932384
+#endif
 
 void ScaleArea(float f, int &iX, int &iY, int &iWidth, int &iHeight);
 
@@ -22,10 +22,22 @@
 #define keyDl			'aadL'
 #define keyDa			'aadA'
 #define keyGaussPrec		'gprC'
+#define keyFlatThreshold	'flaT'
+#define keyAdaptiveAngles	'adpA'
 #define keyPartialStageOutput	'pstO'
 #define keyFastApprox		'fstA'
 #define keyAltAmplitude		'altA'
+#define keyFastLIC		'flcA'
+#define keySIMTWalk		'smtW'
+#define keyBidirectional	'bidW'
+#define keyLumaChroma		'lmaC'
 #define keyIterations		'iteR'
+#define keyConvergenceTolerance	'cnvT'
+#define keyFuseIterations	'fusI'
+#define keyWFormat		'wfmT'
+#define keyAngleScheduling	'angS'
+#define keyTileSize		'tilS'
+#define keyTensorScale		'tnsS'
 #define keyThreads		'thrD'
 #define keyGPU			'gpuB'
 #define keyDisplayMode		'dspM'
@@ -37,7 +49,15 @@
 #define displayModeNormal	'dpM0'
 #define displayModeInside	'dpM1'
 #define displayModeSideBySide	'dpM2'
+#define wFormatFloat		'wfM0'
+#define wFormatHalf		'wfM1'
+#define wFormatFixed		'wfM2'
+#define angleSchedulingPerPass	'anS0'
+#define angleSchedulingFusedTiles	'anS1'
+#define angleSchedulingTasks	'anS2'
 
 #define typeDisplayMode		'dspm'
+#define typeWFormat		'wfmt'
+#define typeAngleScheduling	'angs'
 
 #endif
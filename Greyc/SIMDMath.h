@@ -0,0 +1,198 @@
+#ifndef SIMD_MATH_H
+#define SIMD_MATH_H
+
+/*
+ * Vectorized logf and expf for SSE2 and AVX2.  These are the Cephes single-precision
+ * polynomials; over the ranges we use them for, they're within 2 ulp of the CRT versions.
+ *
+ * Only call the 256-bit versions if GetSIMDFeatures() & SIMD_AVX2, and exp512_ps if
+ * GetSIMDFeatures() & SIMD_AVX512.
+ */
+
+#include <emmintrin.h>
+#include <immintrin.h>
+#include "Helpers.h"
+
+#define SIMD_EXP_HI	88.3762626647949f
+#define SIMD_EXP_LO	-87.3365447504019f
+#define SIMD_LOG2EF	1.44269504088896341f
+#define SIMD_EXP_C1	0.693359375f
+#define SIMD_EXP_C2	-2.12194440e-4f
+#define SIMD_EXP_P0	1.9875691500E-4f
+#define SIMD_EXP_P1	1.3981999507E-3f
+#define SIMD_EXP_P2	8.3334519073E-3f
+#define SIMD_EXP_P3	4.1665795894E-2f
+#define SIMD_EXP_P4	1.6666665459E-1f
+#define SIMD_EXP_P5	5.0000001201E-1f
+
+#define SIMD_SQRTHF	0.707106781186547524f
+#define SIMD_LOG_P0	7.0376836292E-2f
+#define SIMD_LOG_P1	-1.1514610310E-1f
+#define SIMD_LOG_P2	1.1676998740E-1f
+#define SIMD_LOG_P3	-1.2420140846E-1f
+#define SIMD_LOG_P4	1.4249322787E-1f
+#define SIMD_LOG_P5	-1.6668057665E-1f
+#define SIMD_LOG_P6	2.0000714765E-1f
+#define SIMD_LOG_P7	-2.4999993993E-1f
+#define SIMD_LOG_P8	3.3333331174E-1f
+
+/* exp(x).  Inputs are clamped, so large negative values return ~1e-38 instead of 0. */
+static inline __m128 exp_ps(__m128 x)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	x = _mm_min_ps(x, _mm_set1_ps(SIMD_EXP_HI));
+	x = _mm_max_ps(x, _mm_set1_ps(SIMD_EXP_LO));
+
+	/* n = floor(x/ln(2) + 0.5).  SSE2 has no floor; truncate and fix up negative values. */
+	__m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(SIMD_LOG2EF)), _mm_set1_ps(0.5f));
+	__m128 tmp = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+	fx = _mm_sub_ps(tmp, _mm_and_ps(_mm_cmpgt_ps(tmp, fx), one));
+
+	x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(SIMD_EXP_C1)));
+	x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(SIMD_EXP_C2)));
+	const __m128 z = _mm_mul_ps(x, x);
+
+	__m128 y = _mm_set1_ps(SIMD_EXP_P0);
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_EXP_P1));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_EXP_P2));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_EXP_P3));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_EXP_P4));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_EXP_P5));
+	y = _mm_add_ps(_mm_mul_ps(y, z), x);
+	y = _mm_add_ps(y, one);
+
+	/* Multiply by 2^n. */
+	__m128i n = _mm_cvttps_epi32(fx);
+	n = _mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(0x7f)), 23);
+	return _mm_mul_ps(y, _mm_castsi128_ps(n));
+}
+
+/* log(x), for x > 0.  Zero and denormals are treated as FLT_MIN. */
+static inline __m128 log_ps(__m128 x)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	x = _mm_max_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x00800000)));
+
+	/* Split into the exponent e and the mantissa in [0.5,1). */
+	__m128i emm0 = _mm_srli_epi32(_mm_castps_si128(x), 23);
+	x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+	x = _mm_or_ps(x, _mm_set1_ps(0.5f));
+	emm0 = _mm_sub_epi32(emm0, _mm_set1_epi32(0x7f));
+	__m128 e = _mm_add_ps(_mm_cvtepi32_ps(emm0), one);
+
+	/* If the mantissa is below sqrt(0.5), use 2*m-1 and e-1, to keep the polynomial
+	 * argument in [sqrt(0.5)-1, sqrt(2)-1]. */
+	const __m128 mask = _mm_cmplt_ps(x, _mm_set1_ps(SIMD_SQRTHF));
+	__m128 tmp = _mm_and_ps(x, mask);
+	x = _mm_sub_ps(x, one);
+	e = _mm_sub_ps(e, _mm_and_ps(one, mask));
+	x = _mm_add_ps(x, tmp);
+
+	const __m128 z = _mm_mul_ps(x, x);
+	__m128 y = _mm_set1_ps(SIMD_LOG_P0);
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_LOG_P1));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_LOG_P2));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_LOG_P3));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_LOG_P4));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_LOG_P5));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_LOG_P6));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_LOG_P7));
+	y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(SIMD_LOG_P8));
+	y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+
+	y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(SIMD_EXP_C2)));
+	y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+	x = _mm_add_ps(x, y);
+	return _mm_add_ps(x, _mm_mul_ps(e, _mm_set1_ps(SIMD_EXP_C1)));
+}
+
+static inline SIMD_TARGET_AVX2 __m256 exp256_ps(__m256 x)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	x = _mm256_min_ps(x, _mm256_set1_ps(SIMD_EXP_HI));
+	x = _mm256_max_ps(x, _mm256_set1_ps(SIMD_EXP_LO));
+
+	__m256 fx = _mm256_fmadd_ps(x, _mm256_set1_ps(SIMD_LOG2EF), _mm256_set1_ps(0.5f));
+	fx = _mm256_floor_ps(fx);
+
+	x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(SIMD_EXP_C1), x);
+	x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(SIMD_EXP_C2), x);
+	const __m256 z = _mm256_mul_ps(x, x);
+
+	__m256 y = _mm256_set1_ps(SIMD_EXP_P0);
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_EXP_P1));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_EXP_P2));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_EXP_P3));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_EXP_P4));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_EXP_P5));
+	y = _mm256_fmadd_ps(y, z, x);
+	y = _mm256_add_ps(y, one);
+
+	__m256i n = _mm256_cvttps_epi32(fx);
+	n = _mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(0x7f)), 23);
+	return _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+}
+
+static inline SIMD_TARGET_AVX2 __m256 log256_ps(__m256 x)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	x = _mm256_max_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x00800000)));
+
+	__m256i emm0 = _mm256_srli_epi32(_mm256_castps_si256(x), 23);
+	x = _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(~0x7f800000)));
+	x = _mm256_or_ps(x, _mm256_set1_ps(0.5f));
+	emm0 = _mm256_sub_epi32(emm0, _mm256_set1_epi32(0x7f));
+	__m256 e = _mm256_add_ps(_mm256_cvtepi32_ps(emm0), one);
+
+	const __m256 mask = _mm256_cmp_ps(x, _mm256_set1_ps(SIMD_SQRTHF), _CMP_LT_OQ);
+	__m256 tmp = _mm256_and_ps(x, mask);
+	x = _mm256_sub_ps(x, one);
+	e = _mm256_sub_ps(e, _mm256_and_ps(one, mask));
+	x = _mm256_add_ps(x, tmp);
+
+	const __m256 z = _mm256_mul_ps(x, x);
+	__m256 y = _mm256_set1_ps(SIMD_LOG_P0);
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_LOG_P1));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_LOG_P2));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_LOG_P3));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_LOG_P4));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_LOG_P5));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_LOG_P6));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_LOG_P7));
+	y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(SIMD_LOG_P8));
+	y = _mm256_mul_ps(_mm256_mul_ps(y, x), z);
+
+	y = _mm256_fmadd_ps(e, _mm256_set1_ps(SIMD_EXP_C2), y);
+	y = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), y);
+	x = _mm256_add_ps(x, y);
+	return _mm256_fmadd_ps(e, _mm256_set1_ps(SIMD_EXP_C1), x);
+}
+
+static inline SIMD_TARGET_AVX512 __m512 exp512_ps(__m512 x)
+{
+	const __m512 one = _mm512_set1_ps(1.0f);
+	x = _mm512_min_ps(x, _mm512_set1_ps(SIMD_EXP_HI));
+	x = _mm512_max_ps(x, _mm512_set1_ps(SIMD_EXP_LO));
+
+	__m512 fx = _mm512_fmadd_ps(x, _mm512_set1_ps(SIMD_LOG2EF), _mm512_set1_ps(0.5f));
+	fx = _mm512_roundscale_ps(fx, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+
+	x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(SIMD_EXP_C1), x);
+	x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(SIMD_EXP_C2), x);
+	const __m512 z = _mm512_mul_ps(x, x);
+
+	__m512 y = _mm512_set1_ps(SIMD_EXP_P0);
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(SIMD_EXP_P1));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(SIMD_EXP_P2));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(SIMD_EXP_P3));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(SIMD_EXP_P4));
+	y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(SIMD_EXP_P5));
+	y = _mm512_fmadd_ps(y, z, x);
+	y = _mm512_add_ps(y, one);
+
+	__m512i n = _mm512_cvttps_epi32(fx);
+	n = _mm512_slli_epi32(_mm512_add_epi32(n, _mm512_set1_epi32(0x7f)), 23);
+	return _mm512_mul_ps(y, _mm512_castsi512_ps(n));
+}
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * The SIMT walker; see SIMT_AVX2 in GreycC.cpp.  V is the instruction set's wrapper.
+ *
+ * There's no include guard: GreycC.cpp includes this once per instruction set, in its own
+ * namespace and between SIMD_BEGIN_TARGET_* and SIMD_END_TARGET, so each copy is compiled for
+ * its instruction set.  GCC and clang won't build these templates for AVX2 or AVX-512 otherwise.
+ */
+
+/* The bilinear taps of LANES samples, as float offsets into an image with iChannels channels. */
+template<typename V>
+struct SIMTTaps
+{
+	typename V::I cc, nc, cn, nn;
+	typename V::F dx, dy;
+
+	/* Set the taps for fx,fy, clamped to iWidth x iHeight, like LinearTaps::set, for an image
+	 * whose top-left corner is at iX,iY in a larger one with stride iStride. */
+	void set(const typename V::F &fx, const typename V::F &fy, int iWidth, int iHeight, int iX, int iY, int iStride, int iChannels)
+	{
+		const typename V::F nfx = V::clamp(fx, V::zero(), V::set1((float)(iWidth-1)));
+		const typename V::F nfy = V::clamp(fy, V::zero(), V::set1((float)(iHeight-1)));
+		const typename V::I x = V::trunc(nfx);
+		const typename V::I y = V::trunc(nfy);
+		dx = V::sub(nfx, V::to_float(x));
+		dy = V::sub(nfy, V::to_float(y));
+		const typename V::I nx = V::iadd(x, V::ione_if(V::gt(dx, V::zero())));
+		const typename V::I ny = V::iadd(y, V::ione_if(V::gt(dy, V::zero())));
+		const typename V::I channels = V::iset1(iChannels), stride = V::iset1(iStride);
+		const typename V::I row = V::imul(V::iadd(y, V::iset1(iY)), stride);
+		const typename V::I nrow = V::imul(V::iadd(ny, V::iset1(iY)), stride);
+		const typename V::I col = V::imul(V::iadd(x, V::iset1(iX)), channels);
+		const typename V::I ncol = V::imul(V::iadd(nx, V::iset1(iX)), channels);
+		cc = V::iadd(col, row);
+		nc = V::iadd(ncol, row);
+		cn = V::iadd(col, nrow);
+		nn = V::iadd(ncol, nrow);
+	}
+
+	/* Interpolate channel base[0] with the same arithmetic as lerp_ps. */
+	typename V::F lerp(const typename V::F &Icc, const typename V::F &Inc, const typename V::F &Icn, const typename V::F &Inn) const
+	{
+		typename V::F r = V::add(V::sub(Inc, Icc), V::mul(dy, V::sub(V::sub(V::add(Icc, Inn), Icn), Inc)));
+		r = V::add(Icc, V::mul(dx, r));
+		return V::add(r, V::mul(dy, V::sub(Icn, Icc)));
+	}
+
+	typename V::F sample(const float *base, const typename V::M &m) const
+	{
+		return lerp(V::gather(base, cc, m), V::gather(base, nc, m), V::gather(base, cn, m), V::gather(base, nn, m));
+	}
+
+	/* Interpolate u,v (base[1] and base[2]) of W, with each tap flipped to point the same way
+	 * as curru,currv, like linear_uv_aligned. */
+	void sample_uv_aligned(const float *base, const typename V::M &m, const typename V::F &curru, const typename V::F &currv,
+		typename V::F &u, typename V::F &v) const
+	{
+		typename V::F tu[4], tv[4];
+		const typename V::I *idx[4] = { &cc, &nc, &cn, &nn };
+		for(int i = 0; i < 4; ++i)
+		{
+			tu[i] = V::gather(base+1, *idx[i], m);
+			tv[i] = V::gather(base+2, *idx[i], m);
+			const typename V::M flip = V::lt(V::add(V::mul(tu[i], curru), V::mul(tv[i], currv)), V::zero());
+			tu[i] = V::neg_if(flip, tu[i]);
+			tv[i] = V::neg_if(flip, tv[i]);
+		}
+		u = lerp(tu[0], tu[1], tu[2], tu[3]);
+		v = lerp(tv[0], tv[1], tv[2], tv[3]);
+	}
+};
+
+template<typename V, int iChannels, int iInterpolation, bool bFastApprox, bool bAltAmplitude, bool bBidirectional>
+static void do_blur_anisotropic_with_vectors_row_simt(const CImgF &img, const WAccessFloat &W,
+			const CImg &mask, CImgF &dest, float *,
+			int y, int iStartX, int iEndX,
+			const float amplitude,
+			const float dl,
+			const float gauss_prec)
+{
+	typedef typename V::F F;
+	typedef typename V::I I;
+	typedef typename V::M M;
+	const int LANES = V::LANES;
+
+	const float sqrt2amplitude = sqrtf(2*amplitude);
+	const bool no_mask = mask.Empty();
+	const float *pW = W.W.data;
+	const float *pImg = img.data;
+	const int iWX = W.iWX, iWY = W.iWY;
+	const int iWWidth = W.width(), iWHeight = W.height();
+
+	for(int x0 = iStartX; x0 < iEndX; x0 += LANES)
+	{
+		/* Set up each lane the same way as the scalar walker. */
+		float afActive[LANES], afN[LANES], afLength[LANES], afFSigma2[LANES], afFSigma2r[LANES];
+		float afCoefStep[LANES], afCoefStep2[LANES];
+		for(int i = 0; i < LANES; ++i)
+		{
+			const int x = x0 + i;
+			afActive[i] = (x < iEndX && (no_mask || mask(x,y)))? 1.0f:0.0f;
+			const float n = afActive[i]? W.n(x,y):1.0f;
+			const float fsigma = n * sqrt2amplitude;
+			afN[i] = n;
+			afLength[i] = afActive[i]? gauss_prec * fsigma:0;
+			afFSigma2[i] = 2*fsigma*fsigma;
+			afFSigma2r[i] = 1/afFSigma2[i];
+			afCoefStep[i] = afCoefStep2[i] = 0;
+			if(!bFastApprox && !bAltAmplitude)
+			{
+				afCoefStep[i] = expf(-dl*dl*afFSigma2r[i]);
+				afCoefStep2[i] = afCoefStep[i]*afCoefStep[i];
+			}
+		}
+
+		const F n = V::load(afN);
+		const F length = V::load(afLength);
+		const F fsigma2 = V::load(afFSigma2);
+		const F fsigma2r = V::load(afFSigma2r);
+		const F coef_rec_step2 = V::load(afCoefStep2);
+		const F vdl = V::set1(dl);
+		const F dx0 = V::set1((float) iWX), dx1 = V::set1((float) (iWX+iWWidth-1));
+		const F dy0 = V::set1((float) iWY), dy1 = V::set1((float) (iWY+iWHeight-1));
+
+		/* With bBidirectional, walk again for the opposite angle, reusing the setup. */
+		for(int iDirection = 0; iDirection < (bBidirectional? 2:1); ++iDirection)
+		{
+			/* The opposite angle's W is this one's with u and v negated; see WAccessReverse. */
+			const bool bReverse = iDirection == 1;
+
+			F coef_rec = V::set1(1), coef_rec_step = V::load(afCoefStep);
+			F X = V::to_float(V::iadd(V::lane_index(), V::iset1(x0)));
+			F Y = V::set1((float) y);
+			F l = V::zero(), S = V::zero(), pu = V::zero(), pv = V::zero();
+			F acc0 = V::zero(), acc1 = V::zero(), acc2 = V::zero(), acc3 = V::zero();
+
+			M active = V::mask_from_array(afActive);
+			for(;;)
+			{
+				active = V::mand(active, V::lt(l, length));
+				active = V::mand(active, V::mand(V::ge(X, dx0), V::le(X, dx1)));
+				active = V::mand(active, V::mand(V::ge(Y, dy0), V::le(Y, dy1)));
+				if(!V::any(active))
+					break;
+
+				F coef;
+				if(bFastApprox)
+					coef = V::set1(1);
+				else if(!bAltAmplitude)
+					coef = coef_rec;
+				else if(iInterpolation == 0)
+					coef = V::exp(V::mul(V::mul(V::neg(l), l), fsigma2r));
+				else
+					coef = V::exp(V::div(V::mul(V::neg(l), l), fsigma2));
+
+				/* The pixel the step starts in; W is read here for alt_amplitude, and for the
+				 * direction in nearest-neighbor mode and the reference direction in the others. */
+				I cx, cy;
+				if(iInterpolation == 0)
+				{
+					cx = V::round(X);
+					cy = V::round(Y);
+				}
+				else
+				{
+					cx = V::trunc(X);
+					cy = V::trunc(Y);
+				}
+				const I iW = V::iadd(V::imul(V::isub(cx, V::iset1(iWX)), V::iset1(4)), V::imul(V::isub(cy, V::iset1(iWY)), V::iset1(W.W.stride)));
+
+				F u, v;
+				F s0, s1 = V::zero(), s2 = V::zero(), s3 = V::zero();
+				if(iInterpolation == 0)
+				{
+					const I iImg = V::iadd(V::imul(cx, V::iset1(iChannels)), V::imul(cy, V::iset1(img.stride)));
+					s0 = V::gather(pImg+0, iImg, active);
+					if(iChannels >= 2)
+						s1 = V::gather(pImg+1, iImg, active);
+					if(iChannels == 4)
+					{
+						s2 = V::gather(pImg+2, iImg, active);
+						s3 = V::gather(pImg+3, iImg, active);
+					}
+					u = V::gather(pW+1, iW, active);
+					v = V::gather(pW+2, iW, active);
+					if(bReverse) { u = V::neg(u); v = V::neg(v); }
+				}
+				else
+				{
+					const F curru = V::gather(pW+1, iW, active);
+					const F currv = V::gather(pW+2, iW, active);
+
+					/* X,Y is inside W, so these taps aren't clamped, and are the same for img. */
+					SIMTTaps<V> t;
+					t.set(V::sub(X, dx0), V::sub(Y, dy0), iWWidth, iWHeight, 0, 0, W.W.stride, 4);
+					if(iInterpolation == 1)
+					{
+						t.sample_uv_aligned(pW, active, curru, currv, u, v);
+						if(bReverse) { u = V::neg(u); v = V::neg(v); }
+					}
+					else
+					{
+						F u0, v0;
+						t.sample_uv_aligned(pW, active, curru, currv, u0, v0);
+						if(bReverse) { u0 = V::neg(u0); v0 = V::neg(v0); }
+						u0 = V::mul(u0, V::set1(0.5f));
+						v0 = V::mul(v0, V::set1(0.5f));
+						SIMTTaps<V> tmid;
+						tmid.set(V::sub(V::add(X, u0), dx0), V::sub(V::add(Y, v0), dy0), iWWidth, iWHeight, 0, 0, W.W.stride, 4);
+						tmid.sample_uv_aligned(pW, active, curru, currv, u, v);
+						if(bReverse) { u = V::neg(u); v = V::neg(v); }
+					}
+
+					SIMTTaps<V> timg;
+					timg.set(V::sub(X, dx0), V::sub(Y, dy0), iWWidth, iWHeight, iWX, iWY, img.stride, iChannels);
+					s0 = timg.sample(pImg+0, active);
+					if(iChannels >= 2)
+						s1 = timg.sample(pImg+1, active);
+					if(iChannels == 4)
+					{
+						s2 = timg.sample(pImg+2, active);
+						s3 = timg.sample(pImg+3, active);
+					}
+				}
+
+				if(bFastApprox)
+				{
+					acc0 = V::select(active, V::add(acc0, s0), acc0);
+					if(iChannels >= 2)
+						acc1 = V::select(active, V::add(acc1, s1), acc1);
+					if(iChannels == 4)
+					{
+						acc2 = V::select(active, V::add(acc2, s2), acc2);
+						acc3 = V::select(active, V::add(acc3, s3), acc3);
+					}
+				}
+				else
+				{
+					acc0 = V::select(active, V::add(acc0, V::mul(coef, s0)), acc0);
+					if(iChannels >= 2)
+						acc1 = V::select(active, V::add(acc1, V::mul(coef, s1)), acc1);
+					if(iChannels == 4)
+					{
+						acc2 = V::select(active, V::add(acc2, V::mul(coef, s2)), acc2);
+						acc3 = V::select(active, V::add(acc3, V::mul(coef, s3)), acc3);
+					}
+				}
+				S = V::select(active, V::add(S, coef), S);
+
+				const M flip = V::lt(V::add(V::mul(pu, u), V::mul(pv, v)), V::zero());
+				u = V::neg_if(flip, u);
+				v = V::neg_if(flip, v);
+				X = V::select(active, V::add(X, u), X);
+				Y = V::select(active, V::add(Y, v), Y);
+				pu = u; pv = v;
+
+				if(bAltAmplitude)
+				{
+					const F n2 = V::gather(pW, iW, active);
+					l = V::select(active, V::add(l, V::mul(vdl, V::div(n, n2))), l);
+				}
+				else
+				{
+					l = V::add(l, vdl);
+					if(!bFastApprox)
+					{
+						coef_rec = V::mul(coef_rec, coef_rec_step);
+						coef_rec_step = V::mul(coef_rec_step, coef_rec_step2);
+					}
+				}
+			}
+
+			float afS[LANES], afAcc[4][LANES];
+			V::store(afS, S);
+			V::store(afAcc[0], acc0);
+			V::store(afAcc[1], acc1);
+			V::store(afAcc[2], acc2);
+			V::store(afAcc[3], acc3);
+			V::end();
+
+			for(int i = 0; i < LANES; ++i)
+			{
+				if(!afActive[i])
+					continue;
+
+				const int x = x0 + i;
+				if (afS[i]>0)
+					cimgI_for1(iChannels,k)
+						dest(x,y,k) += afAcc[k][i]/afS[i];
+				else
+					cimgI_for1(iChannels,k)
+						dest(x,y,k) += (float)img(x,y,k);
+			}
+		}
+	}
+}
+
+template<typename V, int iChannels, int iInterpolation, bool bFastApprox, bool bAltAmplitude>
+static WalkRow<WAccessFloat>::Func get_simt_walk_row_for_direction(bool bBidirectional)
+{
+	if(bBidirectional)
+		return do_blur_anisotropic_with_vectors_row_simt<V, iChannels, iInterpolation, bFastApprox, bAltAmplitude, true>;
+	else
+		return do_blur_anisotropic_with_vectors_row_simt<V, iChannels, iInterpolation, bFastApprox, bAltAmplitude, false>;
+}
+
+template<typename V, int iChannels, int iInterpolation>
+static WalkRow<WAccessFloat>::Func get_simt_walk_row_for_interpolation(bool fast_approx, bool alt_amplitude, bool bBidirectional)
+{
+	if(fast_approx)
+	{
+		if(alt_amplitude)
+			return get_simt_walk_row_for_direction<V, iChannels, iInterpolation, true, true>(bBidirectional);
+		else
+			return get_simt_walk_row_for_direction<V, iChannels, iInterpolation, true, false>(bBidirectional);
+	}
+	else
+	{
+		if(alt_amplitude)
+			return get_simt_walk_row_for_direction<V, iChannels, iInterpolation, false, true>(bBidirectional);
+		else
+			return get_simt_walk_row_for_direction<V, iChannels, iInterpolation, false, false>(bBidirectional);
+	}
+}
+
+template<typename V, int iChannels>
+static WalkRow<WAccessFloat>::Func get_simt_walk_row_for_channels(const unsigned int interpolation, bool fast_approx, bool alt_amplitude,
+		bool bBidirectional)
+{
+	switch(interpolation)
+	{
+	case 0: return get_simt_walk_row_for_interpolation<V, iChannels, 0>(fast_approx, alt_amplitude, bBidirectional);
+	case 1: return get_simt_walk_row_for_interpolation<V, iChannels, 1>(fast_approx, alt_amplitude, bBidirectional);
+	default: return get_simt_walk_row_for_interpolation<V, iChannels, 2>(fast_approx, alt_amplitude, bBidirectional);
+	}
+}
+
+template<typename V>
+static WalkRow<WAccessFloat>::Func get_simt_walk_row_for_cpu(const unsigned int interpolation, bool fast_approx, bool alt_amplitude,
+		bool bBidirectional, int iChannels)
+{
+	switch(iChannels)
+	{
+	case 1: return get_simt_walk_row_for_channels<V, 1>(interpolation, fast_approx, alt_amplitude, bBidirectional);
+	case 2: return get_simt_walk_row_for_channels<V, 2>(interpolation, fast_approx, alt_amplitude, bBidirectional);
+	default: return get_simt_walk_row_for_channels<V, 4>(interpolation, fast_approx, alt_amplitude, bBidirectional);
+	}
+}
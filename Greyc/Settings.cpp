@@ -55,6 +55,38 @@ namespace
 		return 0;
 	}
 
+	const int WFormatToScript[] =
+	{
+		wFormatFloat,
+		wFormatHalf,
+		wFormatFixed,
+		-1
+	};
+
+	AlgorithmSettings::WFormat ScriptToWFormat(int iVal)
+	{
+		for(int i = 0; WFormatToScript[i] != -1; ++i)
+			if(WFormatToScript[i] == iVal)
+				return (AlgorithmSettings::WFormat) i;
+		return (AlgorithmSettings::WFormat) 0;
+	}
+
+	const int AngleSchedulingToScript[] =
+	{
+		angleSchedulingPerPass,
+		angleSchedulingFusedTiles,
+		angleSchedulingTasks,
+		-1
+	};
+
+	AlgorithmSettings::AngleScheduling ScriptToAngleScheduling(int iVal)
+	{
+		for(int i = 0; AngleSchedulingToScript[i] != -1; ++i)
+			if(AngleSchedulingToScript[i] == iVal)
+				return (AlgorithmSettings::AngleScheduling) i;
+		return (AlgorithmSettings::AngleScheduling) 0;
+	}
+
 	const int DisplayModeToScript[] =
 	{
 		displayModeNormal,
@@ -492,9 +524,19 @@ static void ReadFromKeys(GetKeys &keys, Parameters &params, bool bReadOptions)
 		case keyDl:		params.FilterSettings.dl = keys.GetPercent(); break;
 		case keyDa:		params.FilterSettings.da = keys.GetFloat(); break;
 		case keyGaussPrec:	params.FilterSettings.gauss_prec = keys.GetPercent(); break;
+		case keyFlatThreshold:	params.FilterSettings.flat_threshold = keys.GetFloat(); break;
+		case keyAdaptiveAngles:	params.FilterSettings.adaptive_angles = keys.GetFloat(); break;
 		case keyFastApprox:	params.FilterSettings.fast_approx = keys.GetBoolean(); break;
 		case keyAltAmplitude:	params.FilterSettings.alt_amplitude = keys.GetBoolean(); break;
+		case keyFastLIC:	params.FilterSettings.fast_lic = keys.GetBoolean(); break;
+		case keySIMTWalk:	params.FilterSettings.simt_walk = keys.GetBoolean(); break;
+		case keyBidirectional:	params.FilterSettings.bidirectional = keys.GetBoolean(); break;
+		case keyLumaChroma:	params.FilterSettings.luma_chroma = keys.GetBoolean(); break;
 		case keyIterations:	params.FilterSettings.iterations = keys.GetInteger(); break;
+		case keyConvergenceTolerance:	params.FilterSettings.convergence_tolerance = keys.GetFloat(); break;
+		case keyFuseIterations:	params.FilterSettings.fuse_iterations = keys.GetBoolean(); break;
+		case keyTileSize:	params.FilterSettings.tile_size = keys.GetInteger(); break;
+		case keyTensorScale:	params.FilterSettings.tensor_scale = keys.GetInteger(); break;
 		case keyThreads:	params.FilterOptions.nb_threads = keys.GetInteger(); break;
 		case keyGPU:		params.FilterOptions.m_bGPU = keys.GetBoolean(); break;
 		case keyInterpolation:
@@ -503,6 +545,18 @@ static void ReadFromKeys(GetKeys &keys, Parameters &params, bool bReadOptions)
 			params.FilterSettings.interpolation = ScriptToInterpolation(e);
 			break;
 		}
+		case keyWFormat:
+		{
+			DescriptorEnumID e = keys.GetEnum();
+			params.FilterSettings.w_format = ScriptToWFormat(e);
+			break;
+		}
+		case keyAngleScheduling:
+		{
+			DescriptorEnumID e = keys.GetEnum();
+			params.FilterSettings.angle_scheduling = ScriptToAngleScheduling(e);
+			break;
+		}
 		case keyDisplayMode:
 		{
 			DescriptorEnumID e = keys.GetEnum();
@@ -538,10 +592,22 @@ static void WriteToKeys(PutKeys &keys, const Parameters &params, bool bWriteOpti
 	if(TO_SAVE(dl))			keys.PutPercent(keyDl, params.FilterSettings.dl);
 	if(TO_SAVE(da))			keys.PutFloat(keyDa, params.FilterSettings.da, unitAngle);
 	if(TO_SAVE(gauss_prec))		keys.PutPercent(keyGaussPrec, params.FilterSettings.gauss_prec);
+	if(TO_SAVE(flat_threshold))	keys.PutFloat(keyFlatThreshold, params.FilterSettings.flat_threshold, unitNone);
+	if(TO_SAVE(adaptive_angles))	keys.PutFloat(keyAdaptiveAngles, params.FilterSettings.adaptive_angles, unitNone);
 	if(TO_SAVE(fast_approx))	keys.PutBoolean(keyFastApprox, params.FilterSettings.fast_approx);
 	/*if(TO_SAVE(alt_amplitude))*/	keys.PutBoolean(keyAltAmplitude, params.FilterSettings.alt_amplitude);
+	if(TO_SAVE(fast_lic))		keys.PutBoolean(keyFastLIC, params.FilterSettings.fast_lic);
+	if(TO_SAVE(simt_walk))		keys.PutBoolean(keySIMTWalk, params.FilterSettings.simt_walk);
+	if(TO_SAVE(bidirectional))	keys.PutBoolean(keyBidirectional, params.FilterSettings.bidirectional);
+	if(TO_SAVE(luma_chroma))	keys.PutBoolean(keyLumaChroma, params.FilterSettings.luma_chroma);
 	if(TO_SAVE(iterations))		keys.PutInteger(keyIterations, params.FilterSettings.iterations);
+	if(TO_SAVE(convergence_tolerance))	keys.PutFloat(keyConvergenceTolerance, params.FilterSettings.convergence_tolerance, unitNone);
+	if(TO_SAVE(fuse_iterations))	keys.PutBoolean(keyFuseIterations, params.FilterSettings.fuse_iterations);
 	if(TO_SAVE(interpolation))	keys.PutEnum(keyInterpolation, InterpolationToScript[params.FilterSettings.interpolation], typeInterpolation);
+	if(TO_SAVE(w_format))		keys.PutEnum(keyWFormat, WFormatToScript[params.FilterSettings.w_format], typeWFormat);
+	if(TO_SAVE(angle_scheduling))	keys.PutEnum(keyAngleScheduling, AngleSchedulingToScript[params.FilterSettings.angle_scheduling], typeAngleScheduling);
+	if(TO_SAVE(tile_size))		keys.PutInteger(keyTileSize, params.FilterSettings.tile_size);
+	if(TO_SAVE(tensor_scale))	keys.PutInteger(keyTensorScale, params.FilterSettings.tensor_scale);
 
 	if(bWriteOptions)
 	{
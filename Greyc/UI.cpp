@@ -398,6 +398,7 @@ namespace
 		SetDlgItemFloat(hDlg, IDC_EDIT_DL,		"%-.3g", s.dl);
 		SetDlgItemFloat(hDlg, IDC_EDIT_DA,		"%-.3g", s.da);
 		SetDlgItemFloat(hDlg, IDC_EDIT_GAUSS_PREC,	"%-.3g", s.gauss_prec);
+		SetDlgItemFloat(hDlg, IDC_EDIT_FLAT_THRESHOLD,	"%-.3g", s.flat_threshold);
 		SetDlgItemInt  (hDlg, IDC_EDIT_ITERATIONS,	s.iterations, false);
 		SendMessage(GetDlgItem(hDlg, IDC_STAGE_DISPLAY), CB_SETCURSEL, s.partial_stage_output, 0);
 		SendMessage(GetDlgItem(hDlg, IDC_INTERPOLATE), CB_SETCURSEL, s.interpolation, 0);
@@ -475,6 +476,7 @@ namespace
 		case IDC_EDIT_DL:		return &pSettings.dl;
 		case IDC_EDIT_DA:		return &pSettings.da;
 		case IDC_EDIT_GAUSS_PREC:	return &pSettings.gauss_prec;
+		case IDC_EDIT_FLAT_THRESHOLD:	return &pSettings.flat_threshold;
 		}
 		assert(false);
 		return NULL;
@@ -505,6 +507,7 @@ namespace
 		{ IDC_EDIT_DL,		false,	true, 0.1f,	false, 0,	0.1f },
 		{ IDC_EDIT_DA,		false,	true, 1.0,	true, 360.0f,	0.1f },
 		{ IDC_EDIT_GAUSS_PREC,	false,	true, 0,	false, 0,	0.1f },
+		{ IDC_EDIT_FLAT_THRESHOLD,	false,	true, 0,	false, 0,	1 },
 		{ IDC_EDIT_ITERATIONS,	true,	true, 1,	false, 0,	1 },
 	};
 	const int iNumControls = sizeof(Controls) / sizeof(*Controls);
@@ -41,6 +41,7 @@
 #define IDC_COMBO1                      229
 #define IDC_DISPLAY_MODE                229
 #define IDC_SPIN1                       231
+#define IDC_EDIT_FLAT_THRESHOLD         232
 #define IDS_DEF_LOGFILE                 301
 #define IDS_DEF_MAXSIZE                 302
 #define IDS_DEF_SHRINKTOSIZE            303
@@ -53,7 +54,7 @@
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        204
 #define _APS_NEXT_COMMAND_VALUE         32768
-#define _APS_NEXT_CONTROL_VALUE         232
+#define _APS_NEXT_CONTROL_VALUE         233
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
 #endif